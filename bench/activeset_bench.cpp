@@ -0,0 +1,168 @@
+/*
+* Benchmark: the ident server's set of networks it answers for, under
+* reconnect storm churn. std::set (what CIdentServer used) vs TIdentPtrSet.
+*
+* Every round all networks connect (insert), then flap at random
+* (erase + insert, plus the InUse() check each connect and disconnect
+* does), then all disconnect again (erase).
+*
+* Build and run:
+*   g++ -O2 -std=c++11 -o bench/activeset_bench bench/activeset_bench.cpp && bench/activeset_bench [networks] [rounds]
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published
+* by the Free Software Foundation.
+*/
+
+#include "../identserv_core.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <set>
+#include <vector>
+
+static size_t g_uAllocations = 0;
+
+void *operator new(size_t uSize)
+{
+	g_uAllocations++;
+
+	void *p = malloc(uSize ? uSize : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+/** stands in for CIRCNetwork, big enough that the pointers spread like real ones **/
+struct CFakeNetwork
+{
+	char acData[1024];
+};
+
+struct CStdSet
+{
+	std::set<CFakeNetwork*> set;
+
+	bool Insert(CFakeNetwork *p) { return set.insert(p).second; }
+	bool Erase(CFakeNetwork *p) { return set.erase(p) != 0; }
+	bool IsEmpty() const { return set.empty(); }
+	size_t GetSize() const { return set.size(); }
+};
+
+struct CFlatSet
+{
+	TIdentPtrSet<CFakeNetwork> set;
+
+	bool Insert(CFakeNetwork *p) { return set.Insert(p); }
+	bool Erase(CFakeNetwork *p) { return set.Erase(p); }
+	bool IsEmpty() const { return set.IsEmpty(); }
+	size_t GetSize() const { return set.GetSize(); }
+};
+
+static volatile size_t g_uSink;
+
+struct CResult
+{
+	double dNsPerOp;
+	double dAllocsPerOp;
+	size_t uOps;
+};
+
+template<typename TSet>
+static CResult Run(const std::vector<CFakeNetwork*>& vNetworks, const std::vector<size_t>& vFlaps, size_t uRounds)
+{
+	TSet set;
+	CResult result;
+	size_t uOps = 0;
+
+	const size_t uAllocsBefore = g_uAllocations;
+	const auto tStart = std::chrono::steady_clock::now();
+
+	for(size_t uRound = 0; uRound < uRounds; uRound++)
+	{
+		for(CFakeNetwork *pNetwork : vNetworks)
+		{
+			g_uSink += set.Insert(pNetwork);
+			uOps++;
+		}
+
+		for(size_t uFlap : vFlaps)
+		{
+			CFakeNetwork *pNetwork = vNetworks[uFlap];
+
+			// OnIRCDisconnected, then OnIRCConnecting again:
+			g_uSink += set.Erase(pNetwork);
+			g_uSink += set.IsEmpty();
+			g_uSink += set.Insert(pNetwork);
+			uOps += 2;
+		}
+
+		// no IsEmpty() before the very last one
+		for(CFakeNetwork *pNetwork : vNetworks)
+		{
+			g_uSink += set.Erase(pNetwork);
+			g_uSink += set.IsEmpty();
+			uOps++;
+		}
+
+		if(set.GetSize() != 0)
+		{
+			fprintf(stderr, "set not empty after a round\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	const double dNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - tStart).count();
+
+	result.uOps = uOps;
+	result.dNsPerOp = dNs / uOps;
+	result.dAllocsPerOp = (double)(g_uAllocations - uAllocsBefore) / uOps;
+
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	const size_t uNetworks = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000;
+	const size_t uRounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 200;
+
+	if(uNetworks == 0 || uRounds == 0)
+	{
+		fprintf(stderr, "usage: %s [networks] [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::mt19937 rng(1413);
+	std::vector<CFakeNetwork*> vNetworks;
+
+	for(size_t i = 0; i < uNetworks; i++)
+		vNetworks.push_back(new CFakeNetwork);
+
+	// connect in a different order than they were allocated in
+	std::shuffle(vNetworks.begin(), vNetworks.end(), rng);
+
+	std::vector<size_t> vFlaps;
+	for(size_t i = 0; i < uNetworks * 4; i++)
+		vFlaps.push_back(rng() % uNetworks);
+
+	printf("%zu networks, %zu rounds of connect all / %zu flaps / disconnect all\n\n", uNetworks, uRounds, vFlaps.size());
+	printf("%-14s %12s %10s %10s\n", "set", "ops", "ns/op", "allocs/op");
+
+	const CResult stdResult = Run<CStdSet>(vNetworks, vFlaps, uRounds);
+	printf("%-14s %12zu %10.1f %10.2f\n", "std::set", stdResult.uOps, stdResult.dNsPerOp, stdResult.dAllocsPerOp);
+
+	const CResult flatResult = Run<CFlatSet>(vNetworks, vFlaps, uRounds);
+	printf("%-14s %12zu %10.1f %10.2f\n", "TIdentPtrSet", flatResult.uOps, flatResult.dNsPerOp, flatResult.dAllocsPerOp);
+
+	printf("\n%.1fx\n", stdResult.dNsPerOp / flatResult.dNsPerOp);
+
+	return EXIT_SUCCESS;
+}
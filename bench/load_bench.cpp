@@ -0,0 +1,514 @@
+/*
+* Load generator: many concurrent IDENT connections against a running
+* identserv (the EXPOSEd port 11300), with a mix of valid queries,
+* malformed ones and slowloris style partial lines.
+*
+* Reports connects per second, reply latency and how each kind of
+* connection ended, so the connection-per-second ceiling of the ident
+* server can be found before a netsplit finds it.
+*
+* Build and run:
+*   g++ -O2 -std=c++11 -o bench/load_bench bench/load_bench.cpp && bench/load_bench -H 127.0.0.1 -p 11300
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published
+* by the Free Software Foundation.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static double NowSec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/************************************************************************/
+/*   OPTIONS                                                            */
+/************************************************************************/
+
+struct COptions
+{
+	const char *szHost = "127.0.0.1";
+	const char *szPort = "11300";
+	const char *szQuery = NULL;
+	unsigned int uConcurrency = 100;
+	unsigned int uSeconds = 10;
+	unsigned int uMalformedPct = 10;
+	unsigned int uSlowloris = 10;
+	unsigned int uTimeout = 30;
+};
+
+static void Usage(const char *szName)
+{
+	fprintf(stderr,
+		"usage: %s [-H host] [-p port] [-c connections] [-d seconds]\n"
+		"          [-m malformed %%] [-s slowloris] [-t timeout] [-q \"lport, rport\"]\n"
+		"  -c  query connections kept open at once (default 100)\n"
+		"  -d  seconds to run (default 10)\n"
+		"  -m  share of connections sending malformed queries (default 10)\n"
+		"  -s  extra connections sending half a line and waiting (default 10)\n"
+		"  -t  seconds until a connection counts as timed out (default 30)\n"
+		"  -q  query to send, e.g. the ports of a connected network, default random\n",
+		szName);
+}
+
+/************************************************************************/
+/*   CONNECTIONS                                                        */
+/************************************************************************/
+
+enum EKind
+{
+	KIND_VALID,
+	KIND_MALFORMED,
+	KIND_SLOWLORIS,
+	KIND_COUNT
+};
+
+static const char *g_aszKindNames[] = { "valid", "malformed", "slowloris" };
+
+struct CKindStats
+{
+	size_t uStarted = 0;
+	size_t uConnected = 0;
+	size_t uConnectFailed = 0;
+	size_t uUserId = 0;
+	size_t uError = 0;
+	size_t uOtherReply = 0;
+	size_t uClosedNoReply = 0;
+	size_t uReset = 0;
+	size_t uTimedOut = 0;
+	std::vector<double> vConnectMs;
+	std::vector<double> vReplyMs;
+	std::vector<double> vHeldMs;
+};
+
+struct CConn
+{
+	int iFd = -1;
+	EKind eKind = KIND_VALID;
+	bool bConnected = false;
+	double dStart = 0, dConnected = 0, dDeadline = 0, dRetry = 0;
+	std::string sOut;
+	size_t uSent = 0;
+	std::string sIn;
+};
+
+class CLoad
+{
+protected:
+	const COptions& m_opts;
+	struct addrinfo *m_pAddr;
+	int m_iEpoll;
+	std::vector<CConn> m_vConns;
+	CKindStats m_aStats[KIND_COUNT];
+	unsigned int m_uSeed;
+	size_t m_uConnectsThisSecond, m_uRepliesThisSecond;
+
+	unsigned int Rand()
+	{
+		// xorshift, rand() would be fine too but this one is cheap and per instance
+		m_uSeed ^= m_uSeed << 13;
+		m_uSeed ^= m_uSeed >> 17;
+		m_uSeed ^= m_uSeed << 5;
+		return m_uSeed;
+	}
+
+	std::string MakeRequest(EKind eKind)
+	{
+		static const char *aszMalformed[] = {
+			"garbage\r\n",
+			"99999, 6667\r\n",
+			"0, 0\r\n",
+			"6193, 23 trailing\r\n",
+			", \r\n",
+		};
+
+		char szBuf[64];
+
+		switch(eKind)
+		{
+		case KIND_MALFORMED:
+			if(Rand() % 6 == 0)
+			{
+				// longer than any sane MaxLineLength
+				return std::string(4096, 'x') + "\r\n";
+			}
+			return aszMalformed[Rand() % (sizeof(aszMalformed) / sizeof(aszMalformed[0]))];
+		case KIND_SLOWLORIS:
+			snprintf(szBuf, sizeof(szBuf), "%u, ", 1024 + Rand() % 64000);
+			return szBuf;
+		default:
+			if(m_opts.szQuery)
+				return std::string(m_opts.szQuery) + "\r\n";
+			snprintf(szBuf, sizeof(szBuf), "%u, %u\r\n", 1024 + Rand() % 64000, (Rand() % 2) ? 6667 : 6697);
+			return szBuf;
+		}
+	}
+
+	void Start(size_t uSlot, double dNow)
+	{
+		CConn& conn = m_vConns[uSlot];
+
+		conn = CConn();
+		// the slowloris ones get slots of their own, they would slowly
+		// take over all of them otherwise:
+		if(uSlot >= m_opts.uConcurrency)
+			conn.eKind = KIND_SLOWLORIS;
+		else
+			conn.eKind = (Rand() % 100 < m_opts.uMalformedPct) ? KIND_MALFORMED : KIND_VALID;
+		conn.dStart = dNow;
+		conn.dDeadline = dNow + m_opts.uTimeout;
+		conn.sOut = MakeRequest(conn.eKind);
+
+		CKindStats& stats = m_aStats[conn.eKind];
+		stats.uStarted++;
+
+		conn.iFd = socket(m_pAddr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(conn.iFd < 0)
+		{
+			ConnectFailed(conn, dNow);
+			return;
+		}
+
+		const int iOne = 1;
+		setsockopt(conn.iFd, IPPROTO_TCP, TCP_NODELAY, &iOne, sizeof(iOne));
+
+		if(connect(conn.iFd, m_pAddr->ai_addr, m_pAddr->ai_addrlen) < 0 && errno != EINPROGRESS)
+		{
+			// EADDRNOTAVAIL: out of local ports, see the TIME_WAIT note in Finish
+			ConnectFailed(conn, dNow);
+			return;
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+		ev.data.u64 = uSlot;
+		epoll_ctl(m_iEpoll, EPOLL_CTL_ADD, conn.iFd, &ev);
+	}
+
+	void Finish(CConn& conn, bool bReset)
+	{
+		if(conn.iFd < 0)
+			return;
+
+		if(bReset)
+		{
+			// close with RST, otherwise every finished connection parks a
+			// local port in TIME_WAIT and a long run runs out of them:
+			struct linger lin;
+			lin.l_onoff = 1;
+			lin.l_linger = 0;
+			setsockopt(conn.iFd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+		}
+
+		close(conn.iFd);
+		conn.iFd = -1;
+	}
+
+	void ConnectFailed(CConn& conn, double dNow)
+	{
+		m_aStats[conn.eKind].uConnectFailed++;
+		Finish(conn, false);
+		// don't spin while the server is down or refusing:
+		conn.dRetry = dNow + 0.1;
+	}
+
+	void OnConnected(CConn& conn, double dNow)
+	{
+		CKindStats& stats = m_aStats[conn.eKind];
+
+		conn.bConnected = true;
+		conn.dConnected = dNow;
+		stats.uConnected++;
+		stats.vConnectMs.push_back((dNow - conn.dStart) * 1000);
+		m_uConnectsThisSecond++;
+	}
+
+	/** returns false once the connection is done with **/
+	bool OnWritable(CConn& conn, double dNow)
+	{
+		if(!conn.bConnected)
+		{
+			int iErr = 0;
+			socklen_t uLen = sizeof(iErr);
+			getsockopt(conn.iFd, SOL_SOCKET, SO_ERROR, &iErr, &uLen);
+
+			if(iErr != 0)
+			{
+				ConnectFailed(conn, dNow);
+				return false;
+			}
+
+			OnConnected(conn, dNow);
+		}
+
+		while(conn.uSent < conn.sOut.size())
+		{
+			const ssize_t iSent = send(conn.iFd, conn.sOut.data() + conn.uSent, conn.sOut.size() - conn.uSent, MSG_NOSIGNAL);
+
+			if(iSent < 0)
+			{
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					return true;
+
+				m_aStats[conn.eKind].uReset++;
+				Finish(conn, false);
+				return false;
+			}
+
+			conn.uSent += (size_t)iSent;
+		}
+
+		// all out, only interested in the reply now:
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.u64 = (size_t)(&conn - &m_vConns[0]);
+		epoll_ctl(m_iEpoll, EPOLL_CTL_MOD, conn.iFd, &ev);
+
+		return true;
+	}
+
+	bool OnReadable(CConn& conn, double dNow)
+	{
+		CKindStats& stats = m_aStats[conn.eKind];
+		char szBuf[1024];
+
+		if(!conn.bConnected)
+			OnConnected(conn, dNow);
+
+		for(;;)
+		{
+			const ssize_t iRead = recv(conn.iFd, szBuf, sizeof(szBuf), 0);
+
+			if(iRead > 0)
+			{
+				conn.sIn.append(szBuf, (size_t)iRead);
+
+				const size_t uEol = conn.sIn.find('\n');
+				if(uEol == std::string::npos)
+					continue;
+
+				stats.vReplyMs.push_back((dNow - conn.dConnected) * 1000);
+				m_uRepliesThisSecond++;
+
+				if(conn.sIn.find(": USERID :") < uEol)
+					stats.uUserId++;
+				else if(conn.sIn.find(": ERROR :") < uEol)
+					stats.uError++;
+				else
+					stats.uOtherReply++;
+
+				Finish(conn, true);
+				return false;
+			}
+
+			if(iRead == 0)
+			{
+				// no (full) reply. Expected for slowloris and overlong lines,
+				// the server is supposed to hang up on those.
+				stats.uClosedNoReply++;
+				stats.vHeldMs.push_back((dNow - conn.dConnected) * 1000);
+				Finish(conn, false);
+				return false;
+			}
+
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			if(!conn.bConnected)
+			{
+				ConnectFailed(conn, dNow);
+				return false;
+			}
+
+			stats.uReset++;
+			stats.vHeldMs.push_back((dNow - conn.dConnected) * 1000);
+			Finish(conn, false);
+			return false;
+		}
+	}
+
+	static void PrintLatency(const char *szWhat, std::vector<double>& vMs)
+	{
+		if(vMs.empty())
+			return;
+
+		std::sort(vMs.begin(), vMs.end());
+		printf("    %-10s p50 %9.2f ms  p99 %9.2f ms  max %9.2f ms\n", szWhat,
+			vMs[vMs.size() / 2], vMs[std::min(vMs.size() - 1, vMs.size() * 99 / 100)], vMs.back());
+	}
+public:
+	CLoad(const COptions& opts, struct addrinfo *pAddr) : m_opts(opts), m_pAddr(pAddr), m_vConns(opts.uConcurrency + opts.uSlowloris),
+		m_uSeed(2463534242u), m_uConnectsThisSecond(0), m_uRepliesThisSecond(0)
+	{
+		m_iEpoll = epoll_create1(EPOLL_CLOEXEC);
+	}
+
+	~CLoad()
+	{
+		for(CConn& conn : m_vConns)
+			Finish(conn, true);
+		close(m_iEpoll);
+	}
+
+	void Run()
+	{
+		const double dBegin = NowSec();
+		const double dEnd = dBegin + m_opts.uSeconds;
+		double dNextReport = dBegin + 1;
+		std::vector<struct epoll_event> vEvents(m_vConns.size());
+
+		for(size_t i = 0; i < m_vConns.size(); i++)
+			Start(i, dBegin);
+
+		for(;;)
+		{
+			const int iEvents = epoll_wait(m_iEpoll, &vEvents[0], (int)vEvents.size(), 100);
+			const double dNow = NowSec();
+
+			for(int i = 0; i < iEvents; i++)
+			{
+				const size_t uSlot = (size_t)vEvents[i].data.u64;
+				CConn& conn = m_vConns[uSlot];
+				bool bAlive = true;
+
+				if(conn.iFd < 0)
+					continue;
+
+				if(vEvents[i].events & EPOLLOUT)
+					bAlive = OnWritable(conn, dNow);
+				if(bAlive && (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+					OnReadable(conn, dNow);
+			}
+
+			// reopen closed slots here rather than where they closed, so an
+			// event further down the list can't land on the new socket:
+			bool bAnyOpen = false;
+
+			for(size_t uSlot = 0; uSlot < m_vConns.size(); uSlot++)
+			{
+				CConn& conn = m_vConns[uSlot];
+
+				if(conn.iFd >= 0 && dNow >= conn.dDeadline)
+				{
+					m_aStats[conn.eKind].uTimedOut++;
+					Finish(conn, true);
+				}
+
+				if(conn.iFd < 0 && dNow < dEnd && dNow >= conn.dRetry)
+					Start(uSlot, dNow);
+
+				bAnyOpen |= (conn.iFd >= 0);
+			}
+
+			if(dNow >= dNextReport)
+			{
+				printf("%6.0fs  %7zu connects/s  %7zu replies/s\n", dNow - dBegin, m_uConnectsThisSecond, m_uRepliesThisSecond);
+				fflush(stdout);
+				m_uConnectsThisSecond = m_uRepliesThisSecond = 0;
+				dNextReport += 1;
+			}
+
+			// let the slowloris connections run into the server's timeout:
+			if(dNow >= dEnd && !bAnyOpen)
+				break;
+		}
+
+		const double dElapsed = NowSec() - dBegin;
+		size_t uConnected = 0, uStarted = 0, uFailed = 0;
+
+		for(const CKindStats& stats : m_aStats)
+		{
+			uConnected += stats.uConnected;
+			uStarted += stats.uStarted;
+			uFailed += stats.uConnectFailed + stats.uReset + stats.uTimedOut;
+		}
+
+		printf("\n%zu connections in %.1fs: %.0f connects/s, %.2f%% failed, reset or timed out\n\n",
+			uConnected, dElapsed, uConnected / dElapsed, uStarted ? 100.0 * uFailed / uStarted : 0.0);
+
+		for(int i = 0; i < KIND_COUNT; i++)
+		{
+			CKindStats& stats = m_aStats[i];
+
+			if(!stats.uStarted)
+				continue;
+
+			printf("  %-9s started %zu, connect failed %zu, USERID %zu, ERROR %zu, other reply %zu,\n"
+				"            closed without reply %zu, reset %zu, timed out %zu\n",
+				g_aszKindNames[i], stats.uStarted, stats.uConnectFailed, stats.uUserId, stats.uError, stats.uOtherReply,
+				stats.uClosedNoReply, stats.uReset, stats.uTimedOut);
+			PrintLatency("connect", stats.vConnectMs);
+			PrintLatency("reply", stats.vReplyMs);
+			PrintLatency("held open", stats.vHeldMs);
+		}
+	}
+};
+
+int main(int argc, char **argv)
+{
+	COptions opts;
+	int iOpt;
+
+	while((iOpt = getopt(argc, argv, "H:p:c:d:m:s:t:q:h")) != -1)
+	{
+		switch(iOpt)
+		{
+		case 'H': opts.szHost = optarg; break;
+		case 'p': opts.szPort = optarg; break;
+		case 'c': opts.uConcurrency = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'd': opts.uSeconds = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'm': opts.uMalformedPct = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 's': opts.uSlowloris = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 't': opts.uTimeout = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'q': opts.szQuery = optarg; break;
+		default:
+			Usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(opts.uConcurrency == 0 || opts.uMalformedPct > 100 || opts.uTimeout == 0)
+	{
+		Usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct addrinfo hints, *pAddr = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	const int iErr = getaddrinfo(opts.szHost, opts.szPort, &hints, &pAddr);
+	if(iErr != 0)
+	{
+		fprintf(stderr, "%s:%s: %s\n", opts.szHost, opts.szPort, gai_strerror(iErr));
+		return EXIT_FAILURE;
+	}
+
+	printf("%u connections to %s:%s for %us, %u%% malformed, plus %u slowloris\n\n",
+		opts.uConcurrency, opts.szHost, opts.szPort, opts.uSeconds, opts.uMalformedPct, opts.uSlowloris);
+
+	{
+		CLoad load(opts, pAddr);
+		load.Run();
+	}
+
+	freeaddrinfo(pAddr);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,482 @@
+/*
+* Benchmark: the IDENT lookup path, from request line to reply, against
+* N users x M networks with synthetic IRC socket endpoints.
+*
+* Compares the module's path (TIdentSockIndex, falling back to a scan of the
+* networks not indexed yet on a miss) with the scan-only lookup the module used before the
+* index, for uniform, skewed and miss-heavy query mixes.
+*
+* Build and run:
+*   g++ -O2 -std=c++11 -o bench/lookup_bench bench/lookup_bench.cpp && bench/lookup_bench [users] [networks] [queries]
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published
+* by the Free Software Foundation.
+*/
+
+#include "../identserv_core.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+/************************************************************************/
+/*   ALLOCATION COUNTING                                                */
+/************************************************************************/
+
+static size_t g_uAllocations = 0;
+
+void *operator new(size_t uSize)
+{
+	g_uAllocations++;
+
+	void *p = malloc(uSize ? uSize : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+/************************************************************************/
+/*   FAKE USERS AND NETWORKS                                            */
+/************************************************************************/
+
+struct CFakeUser;
+
+/** stands in for CIRCSock, the getters return copies like Csock's do **/
+struct CFakeSock
+{
+	std::string sLocalIP, sRemoteIP;
+	unsigned short uLocalPort, uRemotePort;
+
+	std::string GetLocalIP() const { return sLocalIP; }
+	std::string GetRemoteIP() const { return sRemoteIP; }
+	unsigned short GetLocalPort() const { return uLocalPort; }
+	unsigned short GetRemotePort() const { return uRemotePort; }
+};
+
+struct CFakeNetwork
+{
+	CFakeUser *pUser;
+	CFakeSock *pSock;
+};
+
+struct CFakeUser
+{
+	std::string sName, sIdent;
+	std::vector<CFakeNetwork*> vNetworks;
+};
+
+struct CFakeTraits
+{
+	static const CFakeSock *GetSock(const CFakeNetwork *pNetwork) { return pNetwork->pSock; }
+
+	static bool IsAfterInScanOrder(const CFakeNetwork *pNetwork, const CFakeNetwork *pOther)
+	{
+		if(pNetwork->pUser != pOther->pUser)
+			return pNetwork->pUser->sName > pOther->pUser->sName;
+
+		for(const CFakeNetwork *pUserNetwork : pNetwork->pUser->vNetworks)
+		{
+			if(pUserNetwork == pNetwork)
+				return false;
+			if(pUserNetwork == pOther)
+				return true;
+		}
+
+		return false;
+	}
+};
+
+typedef TIdentSockIndex<CFakeNetwork, CFakeSock, CFakeTraits> CFakeIndex;
+
+/** what CZNC's user map would hold **/
+struct CFakeWorld
+{
+	std::map<std::string, CFakeUser*> mUsers;
+	std::vector<CFakeNetwork*> vNetworks;
+	std::vector<std::string> vBindHosts, vServers;
+};
+
+static void BuildWorld(CFakeWorld& world, size_t uUsers, size_t uNetworksPerUser, std::mt19937& rng)
+{
+	char szBuf[64];
+
+	for(int i = 0; i < 4; i++)
+	{
+		snprintf(szBuf, sizeof(szBuf), "10.0.0.%d", i + 1);
+		world.vBindHosts.push_back(szBuf);
+	}
+	world.vBindHosts.push_back("2001:db8::1");
+
+	for(int i = 0; i < 32; i++)
+	{
+		snprintf(szBuf, sizeof(szBuf), i % 4 == 3 ? "2001:db8:100::%d" : "198.51.100.%d", i + 1);
+		world.vServers.push_back(szBuf);
+	}
+
+	// every socket gets its own local port, like the kernel would hand out:
+	std::vector<unsigned short> vPorts;
+	for(unsigned int uPort = 1024; uPort <= 65535; uPort++)
+		vPorts.push_back((unsigned short)uPort);
+	std::shuffle(vPorts.begin(), vPorts.end(), rng);
+
+	for(size_t u = 0; u < uUsers; u++)
+	{
+		CFakeUser *pUser = new CFakeUser;
+		snprintf(szBuf, sizeof(szBuf), "user%06zu", u);
+		pUser->sName = szBuf;
+		pUser->sIdent = pUser->sName;
+		world.mUsers[pUser->sName] = pUser;
+
+		for(size_t n = 0; n < uNetworksPerUser; n++)
+		{
+			const bool bV6 = (rng() % 5 == 0);
+			CFakeSock *pSock = new CFakeSock;
+			pSock->sLocalIP = bV6 ? world.vBindHosts.back() : world.vBindHosts[rng() % (world.vBindHosts.size() - 1)];
+			pSock->sRemoteIP = world.vServers[(rng() % (world.vServers.size() / 4)) * 4 + (bV6 ? 3 : rng() % 3)];
+			pSock->uLocalPort = vPorts[world.vNetworks.size() % vPorts.size()];
+			pSock->uRemotePort = (rng() % 2) ? 6667 : 6697;
+
+			CFakeNetwork *pNetwork = new CFakeNetwork;
+			pNetwork->pUser = pUser;
+			pNetwork->pSock = pSock;
+			pUser->vNetworks.push_back(pNetwork);
+			world.vNetworks.push_back(pNetwork);
+		}
+	}
+}
+
+/************************************************************************/
+/*   QUERY MIXES                                                        */
+/************************************************************************/
+
+struct CQuery
+{
+	std::string sLine;
+	CIdentAddr localAddr, remoteAddr;
+	std::string sLocalIP, sRemoteIP;
+};
+
+static CQuery MakeQuery(const CFakeNetwork *pNetwork)
+{
+	CQuery query;
+	query.sLine = std::to_string(pNetwork->pSock->uLocalPort) + ", " + std::to_string(pNetwork->pSock->uRemotePort) + "\r\n";
+	query.sLocalIP = pNetwork->pSock->sLocalIP;
+	query.sRemoteIP = pNetwork->pSock->sRemoteIP;
+	query.localAddr.Parse(query.sLocalIP);
+	query.remoteAddr.Parse(query.sRemoteIP);
+	return query;
+}
+
+/** a query from a host no network is connected to, nothing matches **/
+static CQuery MakeMiss(const CFakeWorld& world, std::mt19937& rng)
+{
+	CQuery query;
+	query.sLine = std::to_string(1 + rng() % 65535) + ", " + std::to_string(1 + rng() % 65535) + "\r\n";
+	query.sLocalIP = world.vBindHosts[rng() % (world.vBindHosts.size() - 1)];
+	query.sRemoteIP = "203.0.113." + std::to_string(1 + rng() % 254);
+	query.localAddr.Parse(query.sLocalIP);
+	query.remoteAddr.Parse(query.sRemoteIP);
+	return query;
+}
+
+enum EMix
+{
+	MIX_UNIFORM,
+	MIX_SKEWED,
+	MIX_MISSES,
+};
+
+static const char *g_aszMixNames[] = { "uniform", "skewed", "miss-heavy" };
+
+static void BuildQueries(std::vector<CQuery>& vQueries, size_t uCount, EMix eMix, const CFakeWorld& world, std::mt19937& rng)
+{
+	const size_t uNetworks = world.vNetworks.size();
+	std::vector<double> vWeights;
+
+	if(eMix == MIX_SKEWED)
+	{
+		// zipf(1.1): a handful of networks reconnecting over and over
+		for(size_t i = 0; i < uNetworks; i++)
+			vWeights.push_back(1.0 / pow((double)(i + 1), 1.1));
+	}
+
+	std::discrete_distribution<size_t> zipf(vWeights.begin(), vWeights.end());
+
+	vQueries.clear();
+
+	for(size_t i = 0; i < uCount; i++)
+	{
+		switch(eMix)
+		{
+		case MIX_UNIFORM:
+			vQueries.push_back(MakeQuery(world.vNetworks[rng() % uNetworks]));
+			break;
+		case MIX_SKEWED:
+			vQueries.push_back(MakeQuery(world.vNetworks[zipf(rng)]));
+			break;
+		case MIX_MISSES:
+			if(rng() % 10 == 0)
+				vQueries.push_back(MakeQuery(world.vNetworks[rng() % uNetworks]));
+			else
+				vQueries.push_back(MakeMiss(world, rng));
+			break;
+		}
+	}
+}
+
+/************************************************************************/
+/*   LOOKUP PATHS                                                       */
+/************************************************************************/
+
+static volatile size_t g_uSink;
+
+/** CIdentServer::ScanNetworks, over the networks that aren't indexed yet **/
+static CFakeNetwork *ScanNetworks(const std::vector<CFakeNetwork*>& vUnindexed, unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& localAddr, const CIdentAddr& remoteAddr)
+{
+	CFakeNetwork *pFound = NULL;
+
+	for(CFakeNetwork *pNetwork : vUnindexed)
+	{
+		const CFakeSock *pSock = pNetwork->pSock;
+
+		if(pSock->GetRemotePort() != uRemotePort)
+			continue;
+
+		CIdentAddr sockLocalAddr;
+		if(!sockLocalAddr.Parse(pSock->GetLocalIP()) || sockLocalAddr != localAddr)
+			continue;
+
+		if(pSock->GetLocalPort() == uLocalPort)
+			return pNetwork;
+
+		CIdentAddr sockRemoteAddr;
+		if(sockRemoteAddr.Parse(pSock->GetRemoteIP()) && sockRemoteAddr == remoteAddr &&
+			(!pFound || CFakeTraits::IsAfterInScanOrder(pNetwork, pFound)))
+			pFound = pNetwork;
+	}
+
+	return pFound;
+}
+
+/** CIdentServer::GetResponse **/
+struct CModulePath
+{
+	const CFakeWorld& world;
+	CFakeIndex index;
+	// everything is indexed up front, as BuildIndex does on load:
+	std::vector<CFakeNetwork*> vUnindexed;
+	CIdentHistory history;
+
+	explicit CModulePath(const CFakeWorld& w) : world(w)
+	{
+		for(CFakeNetwork *pNetwork : world.vNetworks)
+		{
+			CIdentAddr localAddr, remoteAddr;
+			localAddr.Parse(pNetwork->pSock->sLocalIP);
+			remoteAddr.Parse(pNetwork->pSock->sRemoteIP);
+
+			CIdentUserIdCache userId;
+			userId.Set(pNetwork->pUser->sIdent.data(), pNetwork->pUser->sIdent.size(), 1);
+			index.Add(pNetwork, pNetwork->pSock, localAddr, pNetwork->pSock->uLocalPort, remoteAddr, pNetwork->pSock->uRemotePort, userId);
+		}
+	}
+
+	void operator()(const CQuery& query)
+	{
+		CIdentReplyWriter reply;
+		unsigned short uLocalPort = 0, uRemotePort = 0;
+
+		if(IdentParseRequest(query.sLine.data(), query.sLine.size(), uLocalPort, uRemotePort) == IDENT_PARSE_OK)
+		{
+			bool bExact;
+			CFakeIndex::CEntry *pEntry = index.FindEntry(query.localAddr, uLocalPort, uRemotePort, query.remoteAddr, bExact);
+			CFakeNetwork *pNetwork = pEntry ? pEntry->pNetwork : NULL;
+
+			if(!pNetwork && !vUnindexed.empty())
+				pNetwork = ScanNetworks(vUnindexed, uLocalPort, uRemotePort, query.localAddr, query.remoteAddr);
+
+			// idents never change here, the cache is always current:
+			if(pEntry && pEntry->userId.uGeneration != 0)
+				reply.FormatUserId(uLocalPort, uRemotePort, pEntry->userId);
+			else if(pNetwork)
+				reply.FormatUserId(uLocalPort, uRemotePort, pNetwork->pUser->sIdent.data(), pNetwork->pUser->sIdent.size());
+			else
+				reply.FormatError(uLocalPort, uRemotePort, "NO-USER");
+		}
+		else
+		{
+			reply.FormatError(uLocalPort, uRemotePort, "INVALID-PORT");
+		}
+
+		history.Add(query.sLine.data(), query.sLine.size(), query.localAddr, query.remoteAddr, reply.GetData(), reply.GetLineSize());
+		g_uSink += reply.GetSize();
+	}
+};
+
+/** the lookup before the index: sscanf, string compares, string reply **/
+struct CScanPath
+{
+	const CFakeWorld& world;
+
+	explicit CScanPath(const CFakeWorld& w) : world(w) {}
+
+	static bool AreIPStringsEqual(std::string s1, std::string s2)
+	{
+		if(s1.compare(0, 7, "::ffff:") == 0)
+			s1.erase(0, 7);
+		if(s2.compare(0, 7, "::ffff:") == 0)
+			s2.erase(0, 7);
+		return s1 == s2;
+	}
+
+	void operator()(const CQuery& query)
+	{
+		unsigned short uLocalPort = 0, uRemotePort = 0;
+		std::string sReply;
+
+		if(sscanf(query.sLine.c_str(), "%hu , %hu", &uLocalPort, &uRemotePort) == 2)
+		{
+			const CFakeNetwork *pFound = NULL;
+
+			for(auto itu = world.mUsers.begin(); itu != world.mUsers.end(); ++itu)
+			{
+				for(const CFakeNetwork *pNetwork : itu->second->vNetworks)
+				{
+					const CFakeSock *pSock = pNetwork->pSock;
+
+					if(!AreIPStringsEqual(pSock->GetLocalIP(), query.sLocalIP))
+						continue;
+
+					if(pSock->GetLocalPort() == uLocalPort && pSock->GetRemotePort() == uRemotePort)
+					{
+						pFound = pNetwork;
+						goto found;
+					}
+
+					if(pSock->GetRemotePort() == uRemotePort && AreIPStringsEqual(pSock->GetRemoteIP(), query.sRemoteIP))
+						pFound = pNetwork;
+				}
+			}
+found:
+			sReply = std::to_string(uLocalPort) + ", " + std::to_string(uRemotePort);
+			sReply += pFound ? " : USERID : UNIX : " + pFound->pUser->sIdent : " : ERROR : NO-USER";
+		}
+		else
+		{
+			sReply = std::to_string(uLocalPort) + ", " + std::to_string(uRemotePort) + " : ERROR : INVALID-PORT";
+		}
+
+		sReply += "\r\n";
+		g_uSink += sReply.size();
+	}
+};
+
+/************************************************************************/
+/*   MEASUREMENT                                                        */
+/************************************************************************/
+
+struct CResult
+{
+	double dP50Ns, dP99Ns, dAllocsPerQuery, dQueriesPerSec;
+};
+
+template<typename F>
+static CResult Measure(F& fPath, const std::vector<CQuery>& vQueries)
+{
+	typedef std::chrono::steady_clock clock;
+	CResult result;
+	std::vector<double> vNs;
+
+	vNs.reserve(vQueries.size());
+
+	// warm up, e.g. the index's stale list:
+	for(size_t i = 0; i < vQueries.size() && i < 1000; i++)
+		fPath(vQueries[i]);
+
+	const size_t uAllocsBefore = g_uAllocations;
+
+	for(const CQuery& query : vQueries)
+	{
+		const auto tStart = clock::now();
+		fPath(query);
+		vNs.push_back(std::chrono::duration<double, std::nano>(clock::now() - tStart).count());
+	}
+
+	result.dAllocsPerQuery = (double)(g_uAllocations - uAllocsBefore) / vQueries.size();
+
+	std::sort(vNs.begin(), vNs.end());
+	result.dP50Ns = vNs[vNs.size() / 2];
+	result.dP99Ns = vNs[std::min(vNs.size() - 1, vNs.size() * 99 / 100)];
+
+	// again without the per-query clock reads:
+	const auto tStart = clock::now();
+	for(const CQuery& query : vQueries)
+		fPath(query);
+	const double dSeconds = std::chrono::duration<double>(clock::now() - tStart).count();
+
+	result.dQueriesPerSec = vQueries.size() / dSeconds;
+
+	return result;
+}
+
+static void PrintResult(const char *szMix, const char *szPath, size_t uQueries, const CResult& result)
+{
+	printf("%-11s %-7s %9zu %11.0f %11.0f %9.2f %13.0f\n", szMix, szPath, uQueries,
+		result.dP50Ns, result.dP99Ns, result.dAllocsPerQuery, result.dQueriesPerSec);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t uUsers = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+	const size_t uNetworksPerUser = argc > 2 ? strtoul(argv[2], NULL, 10) : 3;
+	const size_t uQueries = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+
+	if(uUsers == 0 || uNetworksPerUser == 0 || uQueries == 0 || uUsers * uNetworksPerUser > 64512)
+	{
+		fprintf(stderr, "usage: %s [users] [networks per user] [queries], at most 64512 networks\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::mt19937 rng(1413);
+	CFakeWorld world;
+	BuildWorld(world, uUsers, uNetworksPerUser, rng);
+
+	CModulePath modulePath(world);
+	CScanPath scanPath(world);
+
+	// the scan is O(networks) per query, don't let it run for minutes:
+	const size_t uScanQueries = std::max<size_t>(1000, std::min(uQueries, (size_t)20000000 / world.vNetworks.size()));
+
+	printf("%zu users x %zu networks = %zu sockets, %zu indexed\n\n", uUsers, uNetworksPerUser,
+		world.vNetworks.size(), modulePath.index.GetSize());
+	printf("%-11s %-7s %9s %11s %11s %9s %13s\n", "mix", "path", "queries", "p50 ns", "p99 ns", "allocs/q", "queries/s");
+
+	const EMix aMixes[] = { MIX_UNIFORM, MIX_SKEWED, MIX_MISSES };
+
+	for(EMix eMix : aMixes)
+	{
+		std::vector<CQuery> vQueries;
+
+		BuildQueries(vQueries, uQueries, eMix, world, rng);
+		PrintResult(g_aszMixNames[eMix], "module", vQueries.size(), Measure(modulePath, vQueries));
+
+		BuildQueries(vQueries, uScanQueries, eMix, world, rng);
+		PrintResult(g_aszMixNames[eMix], "scan", vQueries.size(), Measure(scanPath, vQueries));
+	}
+
+	printf("\np50/p99 include one steady_clock read per query.\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/*
+* Microbenchmark: RFC 1413 request parsing, sscanf vs IdentParseRequest.
+*
+* Build and run:
+*   g++ -O2 -std=c++11 -o bench/parse_bench bench/parse_bench.cpp && bench/parse_bench
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published
+* by the Free Software Foundation.
+*/
+
+#include "../identserv_core.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+static const char *g_aszInputs[] = {
+	"6193, 23\r\n",
+	"  40123 ,  6667\r\n",
+	"65535,65535\r\n",
+	"99999, 6667\r\n",
+	"garbage\r\n",
+};
+
+static const size_t g_uIterations = 2000000;
+
+static volatile unsigned int g_uSink;
+
+template<typename F>
+static double NsPerOp(const std::string& sLine, F fParse)
+{
+	const auto tStart = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i < g_uIterations; i++)
+	{
+		g_uSink += fParse(sLine);
+	}
+
+	const auto tEnd = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(tEnd - tStart).count() / g_uIterations;
+}
+
+int main()
+{
+	printf("%-22s %12s %12s %10s\n", "input", "sscanf ns", "parser ns", "speedup");
+
+	for(const char *szInput : g_aszInputs)
+	{
+		const std::string sLine = szInput;
+		unsigned short uLocal, uRemote, uLocal2, uRemote2;
+
+		// the current path, as in CIdentServer::GetResponse before:
+		const bool bScanOk = (sscanf(sLine.c_str(), "%hu , %hu", &uLocal, &uRemote) == 2);
+		const bool bParseOk = (IdentParseRequest(sLine.data(), sLine.size(), uLocal2, uRemote2) == IDENT_PARSE_OK);
+
+		if(bScanOk && bParseOk && (uLocal != uLocal2 || uRemote != uRemote2))
+		{
+			fprintf(stderr, "parsers disagree on \"%s\"\n", szInput);
+			return EXIT_FAILURE;
+		}
+
+		const double dScan = NsPerOp(sLine, [](const std::string& s) -> unsigned int {
+			unsigned short a = 0, b = 0;
+			return (sscanf(s.c_str(), "%hu , %hu", &a, &b) == 2) ? a + b : 0;
+		});
+
+		const double dParse = NsPerOp(sLine, [](const std::string& s) -> unsigned int {
+			unsigned short a, b;
+			return (IdentParseRequest(s.data(), s.size(), a, b) == IDENT_PARSE_OK) ? a + b : 0;
+		});
+
+		std::string sShown = sLine.substr(0, sLine.find('\r'));
+		printf("%-22s %12.1f %12.1f %9.1fx%s\n", ("\"" + sShown + "\"").c_str(), dScan, dParse, dScan / dParse,
+			(bScanOk && !bParseOk) ? "  (sscanf accepted, parser rejected)" : "");
+	}
+
+	return EXIT_SUCCESS;
+}
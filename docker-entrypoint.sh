@@ -2,28 +2,135 @@
 
 # Options.
 DATADIR="/znc-data"
+JOBS="$(nproc 2>/dev/null || getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)"
 
-if [ ! -f "${DATADIR}/modules/identserv.cpp" ]; then
-  mkdir -p "${DATADIR}/modules"
-  cp /identserv.cpp "${DATADIR}/modules/identserv.cpp"
+# Returns once fewer than $JOBS background jobs are running.
+wait_for_job_slot() {
+  while [ "$(jobs -rp | wc -l)" -ge "$JOBS" ]; do
+    wait -n
+  done
+}
+
+# Run one of the identserv benchmarks instead of ZNC, e.g.
+#   docker run --rm <image> identserv-bench lookup 4000 2
+#   docker run --rm --net host <image> identserv-bench load -H 127.0.0.1 -p 113
+if [ "$1" = "identserv-bench" ]; then
+  bench="${2:-lookup}"
+  shift
+  [ $# -gt 0 ] && shift
+
+  if [ ! -f "/identserv-bench/${bench}_bench.cpp" ]; then
+    echo "Unknown benchmark '${bench}', available:" \
+      $(cd /identserv-bench && ls *_bench.cpp | sed 's/_bench\.cpp$//')
+    exit 1
+  fi
+
+  if ! command -v g++ > /dev/null; then
+    echo "The benchmarks need g++, which this image doesn't have (see Dockerfile.slim)"
+    exit 1
+  fi
+
+  g++ -O2 -std=c++11 -o "/tmp/${bench}_bench" "/identserv-bench/${bench}_bench.cpp" || exit 1
+  exec "/tmp/${bench}_bench" "$@"
 fi
 
-# Build modules from source.
-if [ -d "${DATADIR}/modules" ]; then
-  # Store current directory.
-  cwd="$(pwd)"
+# Build modules from source, each one only when its source, the headers next
+# to it or ZNC changed since the last build. Prebuilt modules shipped in the
+# image are copied instead when they were built from the same files.
+PREBUILT="/identserv-prebuilt"
+ZNC_ID="$(/opt/znc/bin/znc --version 2>&1 | head -n 1) ${CXXFLAGS}"
+
+# Prints the hash a module's build depends on.
+module_hash() {
+  {
+    echo "$ZNC_ID"
+    cat "$1"
+    cat "$(dirname "$1")"/*.h 2>/dev/null
+  } | sha256sum | cut -d ' ' -f 1
+}
+
+# Brings the .so of one module source up to date.
+build_module() {
+  local module="$1"
+  local dir="$(dirname "$module")"
+  local name="$(basename "$module" .cpp)"
+  local stamp="${dir}/.${name}.so.buildhash"
+  local hash="$(module_hash "$module")"
+
+  if [ -f "${dir}/${name}.so" ] && [ "$(cat "$stamp" 2>/dev/null)" = "$hash" ]; then
+    return 0
+  fi
+
+  if [ "$dir" != "$PREBUILT" ] && [ -f "${PREBUILT}/${name}.so" ] && \
+     [ "$(cat "${PREBUILT}/.${name}.so.buildhash" 2>/dev/null)" = "$hash" ]; then
+    echo "Using prebuilt ${name}.so"
+    cp "${PREBUILT}/${name}.so" "${dir}/${name}.so" && echo "$hash" > "$stamp"
+    return
+  fi
+
+  if ! command -v g++ > /dev/null; then
+    echo "Not building ${name}.so, this image has no compiler (see Dockerfile.slim)"
+    return 1
+  fi
+
+  echo "Building ${name}.so"
+  local output
+  if output="$(cd "$dir" && /opt/znc/bin/znc-buildmod "${name}.cpp" 2>&1)"; then
+    echo "$hash" > "$stamp"
+  else
+    echo "$output"
+    echo "Building ${name}.so failed"
+    rm -f "$stamp"
+    return 1
+  fi
+}
+
+# Builds every module under a directory, as many at once as there are cores.
+build_modules() {
+  for module in $(find "$1" -name "*.cpp"); do
+    wait_for_job_slot
+    build_module "$module" &
+  done
+  wait
+}
+
+# Used by the Dockerfile to build the image's copy of identserv.
+if [ "$1" = "identserv-prebuild" ]; then
+  build_modules "$PREBUILT"
+  [ -f "${PREBUILT}/identserv.so" ] || exit 1
+  exit 0
+fi
 
-  # Find module sources.
-  modules=$(find "${DATADIR}/modules" -name "*.cpp")
+# identserv.cpp includes identserv_core.h, so the two are installed as a
+# unit, and only when one of them is missing: an edited copy in the data
+# volume is never overwritten. With IDENTSERV_UPDATE=1 both are replaced by
+# the image's copies whenever they differ, e.g. after pulling a new image.
+install_identserv() {
+  local dir="${DATADIR}/modules"
+  local file
 
-  # Build modules.
-  for module in $modules; do
-    cd "$(dirname "$module")"
-    /opt/znc/bin/znc-buildmod "$module"
+  mkdir -p "$dir"
+  for file in identserv.cpp identserv_core.h; do
+    if [ -f "${dir}/${file}" ] && ! cmp -s "/${file}" "${dir}/${file}"; then
+      echo "Keeping the old ${file} as ${file}.old"
+      mv "${dir}/${file}" "${dir}/${file}.old"
+    fi
   done
+  cp /identserv.cpp /identserv_core.h "${dir}/"
+}
 
-  # Go back to original directory.
-  cd "$cwd"
+if [ ! -f "${DATADIR}/modules/identserv.cpp" ] || [ ! -f "${DATADIR}/modules/identserv_core.h" ]; then
+  echo "Installing identserv.cpp and identserv_core.h from the image"
+  install_identserv
+elif [ "$IDENTSERV_UPDATE" = "1" ] && \
+     { ! cmp -s /identserv.cpp "${DATADIR}/modules/identserv.cpp" || \
+       ! cmp -s /identserv_core.h "${DATADIR}/modules/identserv_core.h"; }; then
+  echo "IDENTSERV_UPDATE=1: replacing identserv.cpp and identserv_core.h with the image's copies"
+  install_identserv
+fi
+
+if [ -d "${DATADIR}/modules" ]; then
+  build_modules "${DATADIR}/modules"
 fi
 
 # Create default config if it doesn't exist
@@ -33,8 +140,63 @@ if [ ! -f "${DATADIR}/configs/znc.conf" ]; then
 fi
 
 # Make sure $DATADIR is owned by znc user. This effects ownership of the
-# mounted directory on the host machine too.
-chown -R znc:znc "$DATADIR"
+# mounted directory on the host machine too. Walking years of logs on every
+# start takes minutes, so the whole tree is only gone through on first init
+# or when znc's UID/GID changed; .znc-owner remembers the one it was done for.
+OWNER="$(id -u znc):$(id -g znc)"
+MARKER="${DATADIR}/.znc-owner"
+
+# Gives whatever under $1 isn't znc's yet to znc, files that are right are
+# only looked at.
+fix_owner() {
+  find "$1" \( ! -user znc -o ! -group znc \) -exec chown -h znc:znc {} +
+}
+
+# The top level entries and every user's directory, checked in parallel.
+# Done ones are listed in .znc-owner.partial, so an interrupted pass picks
+# up where it stopped on the next start.
+fix_all_owners() {
+  local partial="${MARKER}.partial"
+  local trees="$( (find "$DATADIR" -mindepth 1 -maxdepth 1 ! -name users ! -name ".znc-owner*";
+    [ -d "${DATADIR}/users" ] && find "${DATADIR}/users" -mindepth 1 -maxdepth 1) )"
+  local tree
+
+  if [ "$(head -n 1 "$partial" 2>/dev/null)" != "$OWNER" ]; then
+    echo "$OWNER" > "$partial"
+  fi
+
+  echo "Fixing ownership of ${DATADIR} for znc (${OWNER})"
+  chown znc:znc "$DATADIR"
+  [ -d "${DATADIR}/users" ] && chown znc:znc "${DATADIR}/users"
+
+  local IFS=$'\n'
+  for tree in $trees; do
+    grep -qxF "$tree" "$partial" && continue
+    wait_for_job_slot
+    (fix_owner "$tree" && echo "$tree" >> "$partial") &
+  done
+  wait
+
+  for tree in $trees; do
+    if ! grep -qxF "$tree" "$partial"; then
+      echo "Fixing ownership of ${tree} failed, trying again on the next start"
+      return 1
+    fi
+  done
+
+  echo "$OWNER" > "$MARKER"
+  chown znc:znc "$MARKER"
+  rm -f "$partial"
+}
+
+if [ "$(cat "$MARKER" 2>/dev/null)" = "$OWNER" ] && [ "$(stat -c '%u:%g' "$DATADIR")" = "$OWNER" ]; then
+  # only what this script may have written as root:
+  for dir in modules configs; do
+    [ -d "${DATADIR}/${dir}" ] && fix_owner "${DATADIR}/${dir}"
+  done
+else
+  fix_all_owners
+fi
 
 # Start ZNC.
 exec sudo -u znc /opt/znc/bin/znc --foreground --datadir="$DATADIR" $@
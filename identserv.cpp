@@ -16,46 +16,374 @@
 #include "znc/IRCNetwork.h"
 #include "znc/IRCSock.h"
 #include "znc/Modules.h"
+#include "znc/Server.h"
+#include "identserv_core.h"
+#include <deque>
 #include <map>
 #include <set>
+#include <unordered_map>
 
 /************************************************************************/
 /*   CLASS DECLARATIONS                                                 */
 /************************************************************************/
 class CIdentServer;
+class CIdentAcceptedSocket;
+class CIdentMetricsListener;
+class CIdentServiceSource;
+class CIdentServiceSocket;
+
+enum ETraceLevel
+{
+	TRACE_OFF = 0, // summary counters only
+	TRACE_QUERIES = 1, // plus one line per request and reply
+	TRACE_CANDIDATES = 2 // plus every network looked at while scanning
+};
+
+// Only builds the DEBUG() stream if the module's trace level asks for it:
+#define IDENT_TRACE(pMod, eLevel, f) do { if((pMod)->GetTraceLevel() >= (eLevel)) { DEBUG(f); } } while(0)
+
+/**
+* Module settings, given as name=value module arguments or with the Set
+* command (which also saves them).
+**/
+struct CIdentSetting
+{
+	const char *szName;
+	const char *szDescription;
+};
+
+static const CIdentSetting g_aSettings[] = {
+	{ "Trace", "Debug output: 0 = off, only the counters in STATUS and METRICS (default), 1 = requests and replies, 2 = every network checked" },
+	{ "Pipeline", "Answer several requests per connection instead of closing after the first one" },
+	{ "PipelineMaxQueries", "With Pipeline, close a connection after this many requests (0 = no limit)" },
+	{ "PipelineIdleTimeout", "With Pipeline, close a connection after this many idle seconds" },
+	{ "MaxClients", "Refuse IDENT connections while this many are open already (0 = no limit)" },
+	{ "ReadTimeout", "Close an IDENT connection that didn't send a request within this many seconds" },
+	{ "MaxLineLength", "Close an IDENT connection that sends more than this many bytes without a line break" },
+	{ "RateLimit", "IDENT connections per second allowed from one address (0 = no limit)" },
+	{ "RateBurst", "IDENT connections one address may make in a burst before RateLimit applies" },
+	{ "RateTableSize", "Number of addresses RateLimit keeps track of, least recently seen ones are forgotten first" },
+	{ "Persistent", "Keep listening while no network is connecting, instead of closing the port" },
+	{ "Threaded", "Answer IDENT requests on a thread of their own, from a copy of the socket index (no scan of all networks)" },
+	{ "Threads", "With Threaded, number of listener threads sharing the IDENT port through SO_REUSEPORT" },
+	{ "ExportFile", "Keep the connection -> ident table in this memory-mapped file for an identd outside ZNC, relative to ZNC's data directory (empty = off)" },
+	{ "ExportSlots", "Connections the ExportFile has room for" },
+	{ "ListenHosts", "Addresses to open the IDENT port on, separated by spaces, empty for all of them" },
+	{ "ListenBacklog", "Length of the IDENT port's accept queue, capped by the kernel's net.core.somaxconn" },
+	{ "IdentService", "host:port of a service to ask for per network ident overrides, see CIdentServiceSource (empty = the user's ident)" },
+	{ "KernelLookup", "Ask the kernel's TCP table (netlink sock_diag) which connection a request is about before guessing from the server address (not used by Threaded)" },
+	{ "KernelLookupRate", "With KernelLookup, kernel lookups allowed per second, further requests are answered without one (0 = no limit)" },
+	{ "AnswerWindow", "Keep answering for a network this many seconds after it finished connecting" },
+	{ "ConnectWindow", "Networks allowed to be connecting to the same server at once, others wait in ZNC's connect queue (0 = no limit)" },
+	{ "MetricsHost", "Address to serve metrics on, empty for all of them" },
+	{ "MetricsPort", "Serve the METRICS output over HTTP on this port for Prometheus to scrape (0 = off)" },
+};
+
+
+/**
+* Where the ident a network is answered with comes from. GetIdent is on
+* the query path and must never block; a source that has to ask somebody
+* does that from Prefetch and answers from what it got back so far.
+**/
+class CIdentSource
+{
+public:
+	virtual ~CIdentSource() {}
+
+	/** at OnIRCConnecting, well before the server can ask **/
+	virtual void Prefetch(CIRCNetwork * /*pNetwork*/) {}
+	/** the network was deleted **/
+	virtual void Forget(CIRCNetwork * /*pNetwork*/) {}
+	virtual const CString& GetIdent(const CIRCNetwork *pNetwork) = 0;
+};
+
+/**
+* The user's ident, what ZNC sends in USER as well.
+**/
+class CIdentUserSource : public CIdentSource
+{
+public:
+	const CString& GetIdent(const CIRCNetwork *pNetwork) override { return pNetwork->GetUser()->GetIdent(); }
+};
+
+
+/**
+* Tells TIdentSockIndex how to look at ZNC's networks.
+**/
+struct CIdentSockIndexTraits
+{
+	static const CIRCSock *GetSock(const CIRCNetwork *pNetwork) { return pNetwork->GetIRCSock(); }
+	static bool IsAfterInScanOrder(const CIRCNetwork *pNetwork, const CIRCNetwork *pOther);
+};
+
+typedef TIdentSnapshotPublisher<CIRCNetwork, CIdentSockIndexTraits> CIdentSnapshotPublisher;
+
+/**
+* Index of connected IRC sockets, see TIdentSockIndex.
+* Owned by the module, so it survives the listener being closed and reopened.
+* Entries carry their user's ident, ready to send. Bumping the ident
+* generation (for a change one of our hooks saw) makes every one of them
+* look it up again on the next hit, and every hit compares the entry with
+* the ident anyway, which catches the changes no hook of ours sees.
+* With a publisher set, every change is passed on to the Threaded listener's
+* snapshot, with an export table set to the ExportFile. All idents are
+* taken from the ident source.
+**/
+class CIdentSockIndex : public TIdentSockIndex<CIRCNetwork, CIRCSock, CIdentSockIndexTraits>
+{
+protected:
+	uint32_t m_uIdentGeneration;
+	CIdentSnapshotPublisher *m_pPublisher;
+	CIdentExportTable *m_pExport;
+	CIdentUserSource m_userSource;
+	CIdentSource *m_pSource;
+
+	void Export(CIRCNetwork *pNetwork, const CKeys& keys);
+	void OnEntryAdded(const CEntry& entry, const CKeys& keys) override;
+	void OnEntryRemoved(CIRCNetwork *pNetwork, const CKeys& keys) override;
+
+public:
+	// idents can also change where no hook of ours sees it (webadmin, other
+	// modules). The Threaded listener's snapshot and the ExportFile have no
+	// queries on this thread to notice that with, so they may answer with
+	// the old ident for up to this long:
+	static const uint64_t IDENT_RECHECK_NS = 10ULL * 1000 * 1000 * 1000;
+
+	CIdentSockIndex() : m_uIdentGeneration(1), m_pPublisher(NULL), m_pExport(NULL), m_pSource(&m_userSource) {}
+
+	using TIdentSockIndex::Add;
+	bool Add(CIRCNetwork *pNetwork);
+
+	/** "UNIX : <ident>" as the snapshot keeps it **/
+	std::string FormatUserIdText(const CIRCNetwork *pNetwork);
+
+	/** NULL for the user's ident; call InvalidateIdents after this **/
+	void SetSource(CIdentSource *pSource) { m_pSource = pSource ? pSource : &m_userSource; }
+	CIdentSource& GetSource() { return *m_pSource; }
+	const CString& GetIdent(const CIRCNetwork *pNetwork) { return m_pSource->GetIdent(pNetwork); }
+
+	/** NULL to stop publishing; the publisher should start out empty **/
+	void SetPublisher(CIdentSnapshotPublisher *pPublisher);
+	/** NULL to stop exporting, otherwise everything in the index is written to it **/
+	void SetExport(CIdentExportTable *pExport);
+	/** writes every entry's current ident to the export table, unchanged ones cost nothing **/
+	void RefreshExport();
+
+	uint32_t GetIdentGeneration() const { return m_uIdentGeneration; }
+
+
+	void InvalidateIdents()
+	{
+		// 0 means "nothing cached" in CIdentUserIdCache
+		if(++m_uIdentGeneration == 0)
+			m_uIdentGeneration = 1;
+	}
+};
+
+
+/**
+* A ConnectWindow slot: the server it counts against, and since when.
+**/
+struct CIdentConnectSlot
+{
+	CString sServer;
+	time_t tTaken;
+};
+
 
 class CIdentServerMod : public CModule
 {
 protected:
 	unsigned short m_serverPort;
-	CIdentServer *m_identServer;
+	// one per ListenHosts entry, or a single one for all addresses:
+	std::vector<CIdentServer*> m_vIdentServers;
+	VCString m_vsListenHosts;
 	bool m_listenFailed;
-	CString m_sLastReply;
-	CString m_sLastRequest;
+	// false while OnLoad applies the settings, the listener is opened once after that:
+	bool m_bLoaded;
+	// networks IDENT requests are answered for, whichever listener is running:
+	TIdentPtrSet<CIRCNetwork> m_activeUsers;
+	bool m_bThreaded;
+	unsigned int m_uThreads;
+	unsigned int m_uListenBacklog;
+	CIdentSnapshotPublisher m_snapshotPublisher;
+	CIdentThreadServer *m_pThreadServer;
+	CTimer *m_pRefreshTimer;
+	uint32_t m_uRefreshedGeneration; // ident generation the snapshot and export file are from
+	uint64_t m_uNextIdentCheckNs; // when RefreshIdents compares them with the idents again
+	CString m_sExportFile;
+	unsigned int m_uExportSlots;
+	CIdentExportTable m_exportTable;
+	bool m_exportFailed;
+	bool m_bKernelLookup;
+	CIdentSockDiag m_sockDiag;
+	// IRC socket inodes, to tie what sock_diag found back to a network:
+	std::unordered_map<uint64_t, CIRCNetwork*> m_socketInodes;
+	time_t m_tInodesWalked;
+	CString m_sIdentService;
+	CIdentServiceSource *m_pIdentService;
+	// attempts from OnIRCConnecting until 001 or failure, then into the log:
+	std::unordered_map<CIRCNetwork*, CIdentConnectTiming> m_connectTimings;
+	CIdentTimingLog m_timingLog;
+	// connecting, but not in the index yet because the TCP connect isn't through:
+	TIdentPtrSet<CIRCNetwork> m_dirtyNetworks;
+	// where the consistency check carries on with its next slice:
+	CString m_sCheckUser;
+	size_t m_uCheckNetwork;
+
+	// networks the consistency check looks at per tick, besides the dirty ones:
+	static const size_t CHECK_SLICE = 64;
+	CIdentSockIndex m_sockIndex;
+	CIdentHistory m_history;
+	CIdentMetrics m_metrics;
+	ETraceLevel m_eTraceLevel;
+	bool m_bPipeline;
+	unsigned int m_uPipelineMaxQueries;
+	unsigned int m_uPipelineIdleTimeout;
+	unsigned int m_uMaxClients;
+	unsigned int m_uReadTimeout;
+	unsigned int m_uMaxLineLength;
+	std::set<CIdentAcceptedSocket*> m_acceptedSockets;
+	CIdentRateLimiter m_rateLimiter;
+	unsigned int m_uRateLimit;
+	unsigned int m_uRateBurst;
+	bool m_bPersistent;
+	unsigned int m_uAnswerWindow;
+	// networks past OnIRCConnected that are still answered for, and when that ends:
+	std::map<CIRCNetwork*, time_t> m_answerWindows;
+	// the same in deadline order; entries whose network left m_answerWindows are skipped
+	std::deque<std::pair<time_t, CIRCNetwork*> > m_answerWindowQueue;
+	CTimer *m_pAnswerWindowTimer;
+	CTimer *m_pClientTimeoutTimer;
+	unsigned int m_uConnectWindow;
+	// connecting networks that hold a ConnectWindow slot, and the server it's for:
+	std::map<CIRCNetwork*, CIdentConnectSlot> m_connectSlots;
+	std::map<CString, unsigned int> m_connectingPerServer;
+	// networks sent back to the connect queue, waiting for a slot
+	std::set<CIRCNetwork*> m_heldBack;
+	CTimer *m_pConnectSlotTimer;
+	unsigned short m_uMetricsPort;
+	CString m_sMetricsHost;
+	CIdentMetricsListener *m_pMetricsListener;
+	bool m_metricsListenFailed;
+
+	static CString FormatRequest(const CIdentHistoryRecord& rec);
+	static CString FormatDuration(uint64_t uNs);
+	void FinishConnectTiming(CIRCNetwork *pNetwork, bool bConnected);
+	void PutTimings(const CString& sFilter, size_t uCount);
+	static const CIdentSetting *FindSetting(const CString& sName);
+	static bool ParseUInt(const CString& sValue, unsigned int& uValue);
+	bool ApplySetting(const CIdentSetting& setting, const CString& sValue, CString& sError);
+	CString GetSetting(const CIdentSetting& setting) const;
 
 public:
 	MODCONSTRUCTOR(CIdentServerMod)
 	{
 		m_serverPort = 11300;
-		m_identServer = NULL;
 		m_listenFailed = false;
+		m_bLoaded = false;
+		m_bThreaded = false;
+		m_uThreads = 1;
+		m_uListenBacklog = SOMAXCONN;
+		m_pThreadServer = NULL;
+		m_pRefreshTimer = NULL;
+		m_uRefreshedGeneration = 0;
+		m_uNextIdentCheckNs = 0;
+		m_uExportSlots = 4096;
+		m_exportFailed = false;
+		m_bKernelLookup = false;
+		m_sockDiag.SetRate(50);
+		m_tInodesWalked = 0;
+		m_pIdentService = NULL;
+		m_uCheckNetwork = 0;
+		m_eTraceLevel = TRACE_OFF;
+		m_bPipeline = false;
+		m_uPipelineMaxQueries = 16;
+		m_uPipelineIdleTimeout = 10;
+		m_uMaxClients = 128;
+		m_uReadTimeout = 15;
+		m_uMaxLineLength = 512;
+		// off by default: during a reconnect burst all queries come from the few IRC servers
+		m_uRateLimit = 0;
+		m_uRateBurst = 20;
+		m_bPersistent = false;
+		m_uAnswerWindow = 0;
+		m_pAnswerWindowTimer = NULL;
+		m_pClientTimeoutTimer = NULL;
+		m_pConnectSlotTimer = NULL;
+		m_uConnectWindow = 0;
+		m_uMetricsPort = 0;
+		m_pMetricsListener = NULL;
+		m_metricsListenFailed = false;
 	}
 	virtual ~CIdentServerMod();
 
+	bool OnLoad(const CString& sArgs, CString& sMessage) override;
 	EModRet OnIRCConnecting(CIRCSock *pIRCSock) override;
+	EModRet OnIRCRegistration(CString& sPass, CString& sNick, CString& sIdent, CString& sRealName) override;
+	void OnIRCConnectionError(CIRCSock *pIRCSock) override;
 	void OnIRCConnected() override;
 	void OnIRCDisconnected() override;
 	void OnClientLogin() override;
 	EModRet OnDeleteUser(CUser& User) override;
 	EModRet OnDeleteNetwork(CIRCNetwork& Network) override;
+	EModRet OnUserRaw(CString& sLine) override;
+	void OnPostRehash() override;
 	void OnModCommand(const CString& sLine) override;
 
 	void NoLongerNeedsIdentServer();
-
-	CIdentServer *GetIdentServer() { return m_identServer; }
-
-	void SetLastReply(const CString& s) { m_sLastReply = s; };
-	void SetLastRequest(const CString& s) { m_sLastRequest = s; };
+	void NoLongerNeedsIdentServer(const std::vector<CIRCNetwork*>& vNetworks);
+	void ForgetNetworks(const std::vector<CIRCNetwork*>& vNetworks);
+	bool StartIdentServer();
+	void StopIdentServer();
+	void StopIdentServerIfUnused();
+	void RestartIdentServer();
+	bool IsListening() const;
+	void ConfigureThreadServer();
+	void UpdateSnapshotPublishing();
+	void RefreshIdents();
+	void StartRefreshTimer();
+	void RestartExport();
+	void AddSocketInode(CIRCNetwork *pNetwork);
+	CIRCNetwork *FindNetworkByKernel(const CIdentAddr& localAddr, unsigned short uLocalPort, const CIdentAddr& remoteAddr, unsigned short uRemotePort);
+	void ExpireAnswerWindows();
+	bool TakeConnectSlot(CIRCNetwork *pNetwork);
+	void ReleaseConnectSlot(CIRCNetwork *pNetwork);
+	void ExpireConnectSlots();
+	void RestartMetricsListener();
+	CString GetMetricsText();
+
+	bool IncreaseUseCount(CIRCNetwork *pNetwork);
+	bool DecreaseUseCount(CIRCNetwork *pNetwork);
+	size_t DecreaseUseCount(const std::vector<CIRCNetwork*>& vNetworks);
+	void AddIdentTiming(CIRCNetwork *pNetwork, uint64_t uStartNs, uint64_t uEndNs);
+	void BuildIndex();
+	bool CheckNetwork(CIRCNetwork *pNetwork);
+	void CheckConsistency();
+	bool InUse() const { return !m_activeUsers.IsEmpty(); }
+	const TIdentPtrSet<CIRCNetwork>& GetActiveUsers() const { return m_activeUsers; }
+	/** connecting, but not in the index yet **/
+	const TIdentPtrSet<CIRCNetwork>& GetDirtyNetworks() const { return m_dirtyNetworks; }
+
+	/** any of the listeners, NULL while the port is closed **/
+	CIdentServer *GetIdentServer() { return m_vIdentServers.empty() ? NULL : m_vIdentServers.front(); }
+	CIdentSockIndex& GetSockIndex() { return m_sockIndex; }
+	bool UsesKernelLookup() const { return m_sockDiag.IsOpen(); }
+	CIdentHistory& GetHistory() { return m_history; }
+	CIdentMetrics& GetMetrics() { return m_metrics; }
+	ETraceLevel GetTraceLevel() const { return m_eTraceLevel; }
+	bool IsPipelined() const { return m_bPipeline; }
+	unsigned int GetPipelineMaxQueries() const { return m_uPipelineMaxQueries; }
+	unsigned int GetPipelineIdleTimeout() const { return m_uPipelineIdleTimeout; }
+	unsigned int GetMaxClients() const { return m_uMaxClients; }
+	unsigned int GetReadTimeout() const { return m_uReadTimeout; }
+	unsigned int GetMaxLineLength() const { return m_uMaxLineLength; }
+
+	void AddAcceptedSocket(CIdentAcceptedSocket *pSock);
+	void ExpireAcceptedSockets();
+	void RemoveAcceptedSocket(CIdentAcceptedSocket *pSock) { m_acceptedSockets.erase(pSock); }
+	size_t GetAcceptedSocketCount() const { return m_acceptedSockets.size(); }
+	CIdentRateLimiter& GetRateLimiter() { return m_rateLimiter; }
 };
 
 
@@ -66,6 +394,91 @@ public:
 	virtual ~CIdentAcceptedSocket();
 
 	void ReadLine(const CS_STRING & sLine) override;
+	void ReachedMaxBuffer() override;
+
+	/** called by the module when it goes away before this socket does **/
+	void Detach() { m_pIdentMod = NULL; }
+
+	/** closes the connection if its deadline passed, see CIdentServerMod::ExpireAcceptedSockets **/
+	void ExpireIfIdle(uint64_t uNowMs);
+
+protected:
+	CIdentServerMod *m_pIdentMod;
+	bool m_bAddrsParsed;
+	bool m_bDone;
+	unsigned int m_uQueries;
+	// absolute, Csock's read timeout starts over with every byte that comes in:
+	uint64_t m_uDeadlineMs;
+	CString m_sPending; // pipelined replies not written yet
+	CIdentAddr m_localAddr;
+	CIdentAddr m_remoteAddr;
+};
+
+
+/**
+* Per network ident overrides from an outside service, e.g. a provisioning
+* database, over a plain TCP line protocol:
+*   ZNC:     <user>/<network>
+*   service: <user>/<network> <ident>
+* or just "<user>/<network>" for no override. Requests go out at
+* OnIRCConnecting; Write only fills Csock's send buffer, so all networks
+* ZNC connects in one pass of its main loop share a packet. Replies
+* are cached in the socket index like any other ident. Until a network's
+* reply is in (or while the service is down) its user's ident is sent.
+**/
+class CIdentServiceSource : public CIdentSource
+{
+public:
+	CIdentServiceSource(CIdentServerMod *pMod, const CString& sHost, unsigned short uPort);
+	virtual ~CIdentServiceSource();
+
+	void Prefetch(CIRCNetwork *pNetwork) override;
+	void Forget(CIRCNetwork *pNetwork) override;
+	const CString& GetIdent(const CIRCNetwork *pNetwork) override;
+
+	// from CIdentServiceSocket:
+	void OnConnected();
+	void OnReply(const CString& sLine);
+	void OnSocketGone();
+
+	bool IsConnected() const { return m_bConnected; }
+	size_t GetOverrideCount() const { return m_overrides.size(); }
+	size_t GetWaitingCount() const { return m_ssQueued.size() + m_ssSent.size(); }
+
+protected:
+	// don't hammer a service that is down, requests queue up meanwhile:
+	static const time_t RECONNECT_INTERVAL = 10;
+
+	CIdentServerMod *m_pMod;
+	CString m_sHost;
+	unsigned short m_uPort;
+	CIdentServiceSocket *m_pSocket;
+	bool m_bConnected;
+	time_t m_tLastAttempt;
+	std::map<const CIRCNetwork*, CString> m_overrides;
+	// "<user>/<network>", waiting for the connection and sent without a reply yet:
+	std::set<CString> m_ssQueued;
+	std::set<CString> m_ssSent;
+
+	static CString GetName(const CIRCNetwork *pNetwork) { return pNetwork->GetUser()->GetUserName() + "/" + pNetwork->GetName(); }
+	void Connect();
+	void Send(const CString& sName);
+};
+
+class CIdentServiceSocket : public CSocket
+{
+public:
+	CIdentServiceSocket(CModule *pMod, CIdentServiceSource *pSource);
+	virtual ~CIdentServiceSocket();
+
+	void Connected() override;
+	void ReadLine(const CS_STRING & sLine) override;
+
+	/** called by the source when it goes away before this socket does **/
+	void Detach() { m_pSource = NULL; }
+
+protected:
+	CIdentServiceSource *m_pSource;
 };
 
 
@@ -77,25 +490,123 @@ public:
 class CIdentServer : public CSocket
 {
 protected:
-	std::set<CIRCNetwork*> m_activeUsers;
 	CModule *m_pModule;
 	unsigned short m_uPort;
+	CString m_sBindHost;
 
-	static bool AreIPStringsEqual(const CString& sIP1, const CString& sIP2);
+	CIRCNetwork *ScanNetworks(unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& localAddr, const CIdentAddr& remoteAddr, bool& bExact);
 public:
-	CIdentServer(CModule *pMod, unsigned short uPort);
+	CIdentServer(CModule *pMod, unsigned short uPort, const CString& sBindHost);
 	virtual ~CIdentServer();
 
-	bool IncreaseUseCount(CIRCNetwork* pUser);
-	bool DecreaseUseCount(CIRCNetwork* pUser);
-	bool InUse() { return !m_activeUsers.empty(); }
-	bool StartListening();
+	bool StartListening(unsigned int uBacklog);
 
 	Csock *GetSockObj(const CS_STRING & sHostname, u_short uPort) override;
 	bool ConnectionFrom(const CS_STRING & sHostname, u_short uPort) override;
 
-	CString GetResponse(const CString& sLine, const CString& sSocketIP, const CString& sRemoteIP);
-	const std::set<CIRCNetwork*>& GetActiveUsers() { return m_activeUsers; };
+	void GetResponse(const CString& sLine, const CIdentAddr& localAddr, const CIdentAddr& remoteAddr, CIdentReplyWriter& Reply);
+};
+
+
+/**
+* Serves CIdentServerMod::GetMetricsText over HTTP, for Prometheus to scrape.
+**/
+class CIdentMetricsListener : public CSocket
+{
+public:
+	CIdentMetricsListener(CModule *pMod) : CSocket(pMod) {}
+
+	Csock *GetSockObj(const CS_STRING & sHostname, u_short uPort) override;
+};
+
+class CIdentMetricsSocket : public CSocket
+{
+public:
+	CIdentMetricsSocket(CModule *pMod);
+
+	void ReadLine(const CS_STRING & sLine) override;
+	void ReachedMaxBuffer() override;
+
+protected:
+	bool m_bGotRequestLine;
+	bool m_bDone;
+	CString m_sMethod;
+	CString m_sPath;
+
+	void Respond(const CString& sStatus, const CString& sBody);
+};
+
+
+/**
+* One timer for all answer windows, however many networks are connecting.
+**/
+class CIdentAnswerWindowTimer : public CTimer
+{
+public:
+	CIdentAnswerWindowTimer(CIdentServerMod *pMod)
+		: CTimer(pMod, 1, 0, "AnswerWindow", "Ends the IDENT answer window of connected networks") {}
+
+protected:
+	void RunJob() override { static_cast<CIdentServerMod*>(GetModule())->ExpireAnswerWindows(); }
+};
+
+
+/**
+* Frees ConnectWindow slots and connect queue entries that nothing
+* is going to come back for, see CIdentServerMod::ExpireConnectSlots.
+**/
+class CIdentConnectSlotTimer : public CTimer
+{
+public:
+	CIdentConnectSlotTimer(CIdentServerMod *pMod)
+		: CTimer(pMod, 5, 0, "ConnectSlots", "Frees ConnectWindow slots of attempts that went away") {}
+
+protected:
+	void RunJob() override { static_cast<CIdentServerMod*>(GetModule())->ExpireConnectSlots(); }
+};
+
+
+/**
+* Closes accepted IDENT connections that are past their deadline.
+**/
+class CIdentClientTimeoutTimer : public CTimer
+{
+public:
+	CIdentClientTimeoutTimer(CIdentServerMod *pMod)
+		: CTimer(pMod, 1, 0, "IdentClientTimeout", "Closes IDENT connections that took too long to send a request") {}
+
+protected:
+	void RunJob() override { static_cast<CIdentServerMod*>(GetModule())->ExpireAcceptedSockets(); }
+};
+
+
+/**
+* Checks a few networks against the socket index every tick, see
+* CIdentServerMod::CheckConsistency.
+**/
+class CIdentConsistencyTimer : public CTimer
+{
+public:
+	CIdentConsistencyTimer(CIdentServerMod *pMod)
+		: CTimer(pMod, 2, 0, "IdentConsistency", "Checks the IDENT socket index against the networks, a few at a time") {}
+
+protected:
+	void RunJob() override { static_cast<CIdentServerMod*>(GetModule())->CheckConsistency(); }
+};
+
+
+/**
+* Hands idents that changed to the Threaded listener's snapshot and to the
+* ExportFile, neither of which has queries on this thread to notice it with.
+**/
+class CIdentRefreshTimer : public CTimer
+{
+public:
+	CIdentRefreshTimer(CIdentServerMod *pMod)
+		: CTimer(pMod, 1, 0, "IdentRefresh", "Refreshes the idents the IDENT thread and the export file answer with") {}
+
+protected:
+	void RunJob() override { static_cast<CIdentServerMod*>(GetModule())->RefreshIdents(); }
 };
 
 
@@ -103,103 +614,182 @@ public:
 /* CIdentServer method implementation section                           */
 /************************************************************************/
 
-CIdentServer::CIdentServer(CModule *pMod, unsigned short uPort) : CSocket(pMod)
+CIdentServer::CIdentServer(CModule *pMod, unsigned short uPort, const CString& sBindHost) : CSocket(pMod)
 {
 	m_pModule = pMod;
 	m_uPort = uPort;
+	m_sBindHost = sBindHost;
 }
 
-bool CIdentServer::IncreaseUseCount(CIRCNetwork *pUser)
+CIRCNetwork *CIdentServer::ScanNetworks(unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& localAddr, const CIdentAddr& remoteAddr, bool& bExact)
 {
-	if(m_activeUsers.find(pUser) != m_activeUsers.end())
+	CIdentServerMod *pMod = reinterpret_cast<CIdentServerMod*>(m_pModule);
+	CIdentMetrics& metrics = pMod->GetMetrics();
+	const TIdentPtrSet<CIRCNetwork>& dirtyNetworks = pMod->GetDirtyNetworks();
+	CIRCNetwork *pFound = NULL;
+
+	bExact = false;
+
+	// every other connected network is in the index (BuildIndex, the
+	// connect hooks and the consistency check see to that), so a miss is
+	// only worth a second look at the ones still waiting to be indexed:
+	if(dirtyNetworks.IsEmpty())
 	{
-		return false;
+		return NULL;
 	}
 
-	m_activeUsers.insert(pUser);
+	metrics.scans.Inc();
 
-	return true;
-}
+	dirtyNetworks.ForEach([&](CIRCNetwork *pNetwork) {
+		CIRCSock *pSock = pNetwork->GetIRCSock();
 
-bool CIdentServer::DecreaseUseCount(CIRCNetwork *pUser)
-{
-	return (m_activeUsers.erase(pUser) != 0);
+		if(bExact || !pSock)
+			return;
+
+		metrics.scannedNetworks.Inc();
+
+		IDENT_TRACE(pMod, TRACE_CANDIDATES, "Checking user (" << pSock->GetLocalPort() << ", " << pSock->GetRemotePort() << ", " << pSock->GetLocalIP() << ")");
+
+		// both matches need the server port, check it before parsing any addresses:
+		if(pSock->GetRemotePort() != uRemotePort)
+			return;
+
+		CIdentAddr sockLocalAddr;
+		if(!sockLocalAddr.Parse(pSock->GetLocalIP()) || sockLocalAddr != localAddr)
+			return;
+
+		if(pSock->GetLocalPort() == uLocalPort)
+		{
+			// exact match found, the rest is skipped:
+			bExact = true;
+			pFound = pNetwork;
+			return;
+		}
+
+		IDENT_TRACE(pMod, TRACE_CANDIDATES, "Checking user fallback (" << pSock->GetRemoteIP() << ", " << pSock->GetRemotePort() << ", " << pSock->GetLocalIP() << ")");
+
+		CIdentAddr sockRemoteAddr;
+
+		// the set has no order, pick the candidate a walk of the user map would have:
+		if(sockRemoteAddr.Parse(pSock->GetRemoteIP()) && sockRemoteAddr == remoteAddr &&
+			(!pFound || CIdentSockIndexTraits::IsAfterInScanOrder(pNetwork, pFound)))
+		{
+			pFound = pNetwork;
+		}
+	});
+
+	return pFound;
 }
 
-CString CIdentServer::GetResponse(const CString& sLine, const CString& sSocketIP, const CString& sRemoteIP)
+void CIdentServer::GetResponse(const CString& sLine, const CIdentAddr& localAddr, const CIdentAddr& remoteAddr, CIdentReplyWriter& Reply)
 {
 	unsigned short uLocalPort = 0; // local port that ZNC connected to IRC FROM
 	unsigned short uRemotePort = 0; // remote server port that ZNC connected TO, e.g. 6667
 
-	CString sResponseType = "ERROR";
-	CString sAddInfo = "INVALID-PORT";
+	CIdentServerMod *pMod = reinterpret_cast<CIdentServerMod*>(m_pModule);
 
-	DEBUG("IDENT request: " << sLine << " from " << sRemoteIP << " on " << sSocketIP);
+	IDENT_TRACE(pMod, TRACE_QUERIES, "IDENT request: " << sLine << " from " << remoteAddr.ToString() << " on " << localAddr.ToString());
 
-	if(sscanf(sLine.c_str(), "%hu , %hu", &uLocalPort, &uRemotePort) == 2)
-	{
-		sAddInfo = "NO-USER";
+	CIdentMetrics& metrics = pMod->GetMetrics();
+	const uint64_t uStartNs = IdentNowNs();
 
-		for(auto itu = CZNC::Get().GetUserMap().begin();
-			itu != CZNC::Get().GetUserMap().end(); ++itu)
-		{
-			CUser* pUser = itu->second;
-			bool bFound = false;
+	metrics.queries.Inc();
 
-			for(CIRCNetwork* pNetwork : pUser->GetNetworks())
-			{
-				CIRCSock *pSock = pNetwork->GetIRCSock();
+	if(IdentParseRequest(sLine.data(), sLine.size(), uLocalPort, uRemotePort) == IDENT_PARSE_OK)
+	{
+		bool bExact;
+		CIdentSockIndex::CEntry *pEntry = pMod->GetSockIndex().FindEntry(localAddr, uLocalPort, uRemotePort, remoteAddr, bExact);
+		CIRCNetwork *pNetwork = pEntry ? pEntry->pNetwork : NULL;
 
-				if(!pSock)
-					continue;
+		if(pNetwork)
+		{
+			metrics.indexHits.Inc();
 
-				DEBUG("Checking user (" << pSock->GetLocalPort() << ", " << pSock->GetRemotePort() << ", " << pSock->GetLocalIP() << ")");
+			CIdentSockIndex& index = pMod->GetSockIndex();
+			const CString& sIdent = index.GetIdent(pNetwork);
 
-				if(pSock->GetLocalPort() == uLocalPort &&
-					pSock->GetRemotePort() == uRemotePort &&
-					AreIPStringsEqual(pSock->GetLocalIP(), sSocketIP))
+			// one compare per hit, so webadmin or another module changing it doesn't go unnoticed:
+			if(pEntry->userId.uGeneration != index.GetIdentGeneration() || !pEntry->userId.Matches(sIdent.data(), sIdent.size()))
+			{
+				if(pEntry->userId.uGeneration == index.GetIdentGeneration())
 				{
-					sResponseType = "USERID";
-					sAddInfo = "UNIX : " + pUser->GetIdent();
-					// exact match found, leave the loop:
-					bFound = true;
-					break;
+					// changed behind our back, the other entries may be out of date too:
+					index.InvalidateIdents();
 				}
+				pEntry->userId.Set(sIdent.data(), sIdent.size(), index.GetIdentGeneration());
+			}
+		}
 
-				DEBUG("Checking user fallback (" << pSock->GetRemoteIP() << ", " << pSock->GetRemotePort() << ", " << pSock->GetLocalIP() << ")");
+		if(!bExact && pMod->UsesKernelLookup())
+		{
+			// the kernel knows which socket the request is about, the fallback only guesses:
+			CIRCNetwork *pKernelNetwork = pMod->FindNetworkByKernel(localAddr, uLocalPort, remoteAddr, uRemotePort);
 
-				if(pSock->GetRemoteIP() == sRemoteIP &&
-					pSock->GetRemotePort() == uRemotePort &&
-					AreIPStringsEqual(pSock->GetLocalIP(), sSocketIP))
+			if(pKernelNetwork)
+			{
+				if(pKernelNetwork != pNetwork)
 				{
-					sResponseType = "USERID";
-					sAddInfo = "UNIX : " + pUser->GetIdent();
-					// keep looping, we may find something better
+					pMod->GetSockIndex().Add(pKernelNetwork);
 				}
+				pNetwork = pKernelNetwork;
+				pEntry = NULL;
+				bExact = true;
 			}
-
-			if(bFound)
-				break;
 		}
-	}
 
-	CString sReply = CString(uLocalPort) + ", " + CString(uRemotePort) + " : " + sResponseType + " : " + sAddInfo;
+		if(!pNetwork)
+		{
+			// not indexed yet, e.g. the TCP connect finished since the last consistency check:
+			pNetwork = ScanNetworks(uLocalPort, uRemotePort, localAddr, remoteAddr, bExact);
 
-	DEBUG("IDENT response: " << sReply);
+			if(pNetwork)
+			{
+				pMod->GetSockIndex().Add(pNetwork);
+			}
+		}
 
-	CIdentServerMod *pMod = reinterpret_cast<CIdentServerMod*>(m_pModule);
-	if(pMod)
+		if(pEntry && pEntry->userId.uGeneration != 0)
+		{
+			Reply.FormatUserId(uLocalPort, uRemotePort, pEntry->userId);
+		}
+		else if(pNetwork)
+		{
+			// found by the kernel or the scan, or an ident too long to cache
+			const CString& sIdent = pMod->GetSockIndex().GetIdent(pNetwork);
+			Reply.FormatUserId(uLocalPort, uRemotePort, sIdent.data(), sIdent.size());
+		}
+
+		if(pNetwork)
+		{
+			metrics.replyUserId.Inc();
+			(bExact ? metrics.exactMatches : metrics.fallbackMatches).Inc();
+			pMod->AddIdentTiming(pNetwork, uStartNs, IdentNowNs());
+		}
+		else
+		{
+			Reply.FormatError(uLocalPort, uRemotePort, "NO-USER");
+			metrics.replyNoUser.Inc();
+		}
+	}
+	else
 	{
-		pMod->SetLastRequest(sLine.Replace_n("\r", "").Replace_n("\n", " ") + "from " + sRemoteIP + " on " + sSocketIP);
-		pMod->SetLastReply(sReply);
+		Reply.FormatError(uLocalPort, uRemotePort, "INVALID-PORT");
+		metrics.replyInvalidPort.Inc();
 	}
 
-	return sReply;
+	metrics.lookupLatency.Add(IdentNowNs() - uStartNs);
+
+	IDENT_TRACE(pMod, TRACE_QUERIES, "IDENT response: " << CString(Reply.GetData(), Reply.GetLineSize()));
+
+	// only copied here, formatted when somebody runs STATUS or HISTORY:
+	pMod->GetHistory().Add(sLine.data(), sLine.size(), localAddr, remoteAddr, Reply.GetData(), Reply.GetLineSize());
 }
 
-bool CIdentServer::StartListening()
+bool CIdentServer::StartListening(unsigned int uBacklog)
 {
-	return GetModule()->GetManager()->ListenAll(m_uPort, "IDENT_SERVER", false, SOMAXCONN, this);
+	return m_sBindHost.empty() ?
+		GetModule()->GetManager()->ListenAll(m_uPort, "IDENT_SERVER", false, (int)uBacklog, this) :
+		GetModule()->GetManager()->ListenHost(m_uPort, "IDENT_SERVER", m_sBindHost, false, (int)uBacklog, this);
 }
 
 Csock *CIdentServer::GetSockObj(const CS_STRING & sHostname, u_short uPort)
@@ -209,14 +799,31 @@ Csock *CIdentServer::GetSockObj(const CS_STRING & sHostname, u_short uPort)
 
 bool CIdentServer::ConnectionFrom(const CS_STRING & sHostname, u_short uPort)
 {
-	DEBUG("IDENT connection from " << sHostname << ":" << uPort << " (on " << GetLocalIP() << ":" << GetLocalPort() << ")");
+	CIdentServerMod *pMod = reinterpret_cast<CIdentServerMod*>(m_pModule);
 
-	return (!m_activeUsers.empty());
-}
+	IDENT_TRACE(pMod, TRACE_QUERIES, "IDENT connection from " << sHostname << ":" << uPort << " (on " << GetLocalIP() << ":" << GetLocalPort() << ")");
 
-bool CIdentServer::AreIPStringsEqual(const CString& sIP1, const CString& sIP2)
-{
-	return sIP1.TrimPrefix_n("::ffff:").Equals(sIP2.TrimPrefix_n("::ffff:"));
+	if(!pMod->InUse())
+	{
+		// nothing is connecting, don't spend anybody's RateLimit tokens on it
+		return false;
+	}
+
+	if(pMod->GetMaxClients() > 0 && pMod->GetAcceptedSocketCount() >= pMod->GetMaxClients())
+	{
+		// refused before a socket object is created for it
+		pMod->GetMetrics().refused.Inc();
+		return false;
+	}
+
+	CIdentAddr remoteAddr;
+	if(remoteAddr.Parse(sHostname) && !pMod->GetRateLimiter().Allow(remoteAddr, IdentNowMs()))
+	{
+		pMod->GetMetrics().rateLimited.Inc();
+		return false;
+	}
+
+	return true;
 }
 
 CIdentServer::~CIdentServer()
@@ -225,77 +832,1775 @@ CIdentServer::~CIdentServer()
 
 
 /************************************************************************/
-/* CIdentAcceptedSocket method implementation section                   */
+/* CIdentServiceSource method implementation section                    */
 /************************************************************************/
 
-CIdentAcceptedSocket::CIdentAcceptedSocket(CModule *pMod) : CSocket(pMod)
+CIdentServiceSource::CIdentServiceSource(CIdentServerMod *pMod, const CString& sHost, unsigned short uPort)
 {
-	EnableReadLine();
+	m_pMod = pMod;
+	m_sHost = sHost;
+	m_uPort = uPort;
+	m_pSocket = NULL;
+	m_bConnected = false;
+	m_tLastAttempt = 0;
+
+	// up before the first connect burst:
+	Connect();
 }
 
-void CIdentAcceptedSocket::ReadLine(const CS_STRING & sLine)
+CIdentServiceSource::~CIdentServiceSource()
 {
-	CIdentServerMod *pMod = reinterpret_cast<CIdentServerMod*>(m_pModule);
-	const CString sReply = pMod->GetIdentServer()->GetResponse(sLine, GetLocalIP(), GetRemoteIP());
+	if(m_pSocket)
+	{
+		m_pSocket->Detach();
+		m_pSocket->Close();
+	}
+}
 
-	Write(sReply + "\r\n");
+void CIdentServiceSource::Connect()
+{
+	m_tLastAttempt = time(NULL);
+	m_pSocket = new CIdentServiceSocket(m_pMod, this);
 
-	Close(CLT_AFTERWRITE);
+	if(!m_pSocket->Connect(m_sHost, m_uPort, false, 10))
+	{
+		// not handed to the socket manager
+		m_pSocket->Detach();
+		delete m_pSocket;
+		m_pSocket = NULL;
+	}
 }
 
-CIdentAcceptedSocket::~CIdentAcceptedSocket()
+void CIdentServiceSource::Send(const CString& sName)
 {
+	m_ssSent.insert(sName);
+	m_pSocket->Write(sName + "\n");
 }
 
-
-/************************************************************************/
-/* CIdentServerMod method implementation section                        */
-/************************************************************************/
-
-CIdentServerMod::EModRet CIdentServerMod::OnIRCConnecting(CIRCSock *pIRCSock)
+void CIdentServiceSource::Prefetch(CIRCNetwork *pNetwork)
 {
-	assert(m_pNetwork != NULL);
+	const CString sName = GetName(pNetwork);
 
-	DEBUG("CIdentServerMod::OnIRCConnecting");
-
-	if(!m_identServer)
+	if(m_ssSent.count(sName))
 	{
-		DEBUG("Starting up IDENT listener.");
-		m_identServer = new CIdentServer(this, m_serverPort);
+		return;
+	}
 
-		if(!m_identServer->StartListening())
-		{
-			DEBUG("WARNING: Opening the listening socket failed!");
-			m_listenFailed = true;
-			m_identServer = NULL; /* Csock deleted the instance. (gross) */
-			return CONTINUE;
-		}
-		else
-		{
-			m_listenFailed = false;
-		}
+	if(m_bConnected)
+	{
+		Send(sName);
+		return;
 	}
 
-	m_identServer->IncreaseUseCount(m_pNetwork);
+	m_ssQueued.insert(sName);
 
-	return CONTINUE;
+	if(!m_pSocket && time(NULL) - m_tLastAttempt >= RECONNECT_INTERVAL)
+	{
+		Connect();
+	}
 }
 
-void CIdentServerMod::NoLongerNeedsIdentServer()
+void CIdentServiceSource::Forget(CIRCNetwork *pNetwork)
+{
+	m_overrides.erase(pNetwork);
+}
+
+const CString& CIdentServiceSource::GetIdent(const CIRCNetwork *pNetwork)
+{
+	auto it = m_overrides.find(pNetwork);
+
+	return it != m_overrides.end() ? it->second : pNetwork->GetUser()->GetIdent();
+}
+
+void CIdentServiceSource::OnConnected()
+{
+	m_bConnected = true;
+
+	for(const CString& sName : m_ssQueued)
+	{
+		Send(sName);
+	}
+	m_ssQueued.clear();
+}
+
+void CIdentServiceSource::OnReply(const CString& sLine)
+{
+	const CString sName = sLine.Token(0);
+	const CString sIdent = sLine.Token(1);
+
+	if(!m_ssSent.erase(sName))
+	{
+		DEBUG("identserv: unasked for reply from the ident service: " << sLine);
+		return;
+	}
+
+	CUser *pUser = CZNC::Get().FindUser(sName.Token(0, false, "/"));
+	CIRCNetwork *pNetwork = pUser ? pUser->FindNetwork(sName.Token(1, true, "/")) : NULL;
+
+	if(!pNetwork)
+	{
+		// deleted while we were waiting
+		return;
+	}
+
+	auto it = m_overrides.find(pNetwork);
+
+	if(sIdent.empty() || IdentSafeLength(sIdent.data(), sIdent.size(), CIdentReplyWriter::MAX_USERID) != sIdent.size())
+	{
+		if(!sIdent.empty())
+		{
+			DEBUG("identserv: ignoring unusable ident from the ident service for " << sName);
+		}
+		if(it == m_overrides.end())
+		{
+			return;
+		}
+		m_overrides.erase(it);
+	}
+	else if(it == m_overrides.end() || it->second != sIdent)
+	{
+		m_overrides[pNetwork] = sIdent;
+	}
+	else
+	{
+		return;
+	}
+
+	// usually the socket isn't even connected yet; if it is, this updates
+	// its index entry, the snapshot and the export file:
+	m_pMod->GetSockIndex().Add(pNetwork);
+}
+
+void CIdentServiceSource::OnSocketGone()
+{
+	m_pSocket = NULL;
+	m_bConnected = false;
+
+	// asked again once there's a connection, the user's ident is sent meanwhile:
+	m_ssQueued.insert(m_ssSent.begin(), m_ssSent.end());
+	m_ssSent.clear();
+}
+
+
+/************************************************************************/
+/* CIdentServiceSocket method implementation section                    */
+/************************************************************************/
+
+CIdentServiceSocket::CIdentServiceSocket(CModule *pMod, CIdentServiceSource *pSource) : CSocket(pMod)
+{
+	m_pSource = pSource;
+
+	EnableReadLine();
+}
+
+CIdentServiceSocket::~CIdentServiceSocket()
+{
+	if(m_pSource)
+	{
+		m_pSource->OnSocketGone();
+	}
+}
+
+void CIdentServiceSocket::Connected()
+{
+	// idle between connect bursts, that's fine:
+	SetTimeout(0);
+
+	if(m_pSource)
+	{
+		m_pSource->OnConnected();
+	}
+}
+
+void CIdentServiceSocket::ReadLine(const CS_STRING & sLine)
+{
+	if(m_pSource)
+	{
+		m_pSource->OnReply(CString(sLine).TrimRight_n("\r\n"));
+	}
+}
+
+
+/************************************************************************/
+/* CIdentSockIndex method implementation section                        */
+/************************************************************************/
+
+bool CIdentSockIndex::Add(CIRCNetwork *pNetwork)
+{
+	CIRCSock *pSock = pNetwork->GetIRCSock();
+	CIdentAddr localAddr, remoteAddr;
+
+	Remove(pNetwork);
+
+	if(!pSock || !pSock->IsConnected())
+	{
+		return false;
+	}
+
+	if(!localAddr.Parse(pSock->GetLocalIP()) || !remoteAddr.Parse(pSock->GetRemoteIP()))
+	{
+		return false;
+	}
+
+	// while the user's objects are warm anyway:
+	CIdentUserIdCache userId;
+	const CString& sIdent = GetIdent(pNetwork);
+	userId.Set(sIdent.data(), sIdent.size(), GetIdentGeneration());
+
+	Add(pNetwork, pSock, localAddr, pSock->GetLocalPort(), remoteAddr, pSock->GetRemotePort(), userId);
+
+	return true;
+}
+
+std::string CIdentSockIndex::FormatUserIdText(const CIRCNetwork *pNetwork)
+{
+	const CString& sIdent = GetIdent(pNetwork);
+
+	return "UNIX : " + sIdent.substr(0, IdentSafeLength(sIdent.data(), sIdent.size(), CIdentReplyWriter::MAX_USERID));
+}
+
+void CIdentSockIndex::SetPublisher(CIdentSnapshotPublisher *pPublisher)
+{
+	m_pPublisher = pPublisher;
+
+	if(!m_pPublisher)
+	{
+		return;
+	}
+
+	m_pPublisher->BeginBatch();
+	ForEach([this](CIRCNetwork *pNetwork, const CKeys& keys) {
+		m_pPublisher->Add(pNetwork, keys.exact, keys.peer, FormatUserIdText(pNetwork));
+	});
+	m_pPublisher->EndBatch();
+}
+
+void CIdentSockIndex::SetExport(CIdentExportTable *pExport)
+{
+	m_pExport = pExport;
+	RefreshExport();
+}
+
+void CIdentSockIndex::RefreshExport()
+{
+	if(m_pExport)
+	{
+		ForEach([this](CIRCNetwork *pNetwork, const CKeys& keys) { Export(pNetwork, keys); });
+	}
+}
+
+void CIdentSockIndex::Export(CIRCNetwork *pNetwork, const CKeys& keys)
+{
+	const CString& sIdent = GetIdent(pNetwork);
+
+	if(!m_pExport->Set(keys.exact.localAddr, keys.exact.uLocalPort, keys.exact.uRemotePort, keys.peer.remoteAddr, sIdent.data(), sIdent.size()))
+	{
+		DEBUG("identserv: the export file is full, not exporting " << pNetwork->GetUser()->GetUserName() << "/" << pNetwork->GetName());
+	}
+}
+
+void CIdentSockIndex::OnEntryAdded(const CEntry& entry, const CKeys& keys)
+{
+	if(m_pPublisher)
+	{
+		m_pPublisher->Add(entry.pNetwork, keys.exact, keys.peer, FormatUserIdText(entry.pNetwork));
+	}
+
+	if(m_pExport)
+	{
+		Export(entry.pNetwork, keys);
+	}
+}
+
+void CIdentSockIndex::OnEntryRemoved(CIRCNetwork *pNetwork, const CKeys& keys)
+{
+	if(m_pPublisher)
+	{
+		m_pPublisher->Remove(pNetwork, keys.exact, keys.peer);
+	}
+
+	if(m_pExport)
+	{
+		m_pExport->Remove(keys.exact.localAddr, keys.exact.uLocalPort, keys.exact.uRemotePort, keys.peer.remoteAddr);
+	}
+}
+
+bool CIdentSockIndexTraits::IsAfterInScanOrder(const CIRCNetwork *pNetwork, const CIRCNetwork *pOther)
+{
+	// CIdentServer::ScanNetworks picks the last fallback candidate in user map
+	// order, keep answering the same way:
+	const CUser *pUser = pNetwork->GetUser(), *pOtherUser = pOther->GetUser();
+
+	if(pUser != pOtherUser)
+	{
+		return pUser->GetUserName() > pOtherUser->GetUserName();
+	}
+
+	for(const CIRCNetwork *pUserNetwork : pUser->GetNetworks())
+	{
+		if(pUserNetwork == pNetwork)
+			return false;
+		if(pUserNetwork == pOther)
+			return true;
+	}
+
+	return false;
+}
+
+
+/************************************************************************/
+/* CIdentAcceptedSocket method implementation section                   */
+/************************************************************************/
+
+CIdentAcceptedSocket::CIdentAcceptedSocket(CModule *pMod) : CSocket(pMod)
+{
+	m_pIdentMod = reinterpret_cast<CIdentServerMod*>(pMod);
+	m_bAddrsParsed = false;
+	m_bDone = false;
+	m_uQueries = 0;
+	EnableReadLine();
+
+	// a request is a few bytes, don't buffer kilobytes of junk from a flood:
+	SetMaxBufferThreshold(m_pIdentMod->GetMaxLineLength());
+	m_uDeadlineMs = IdentNowMs() + 1000ULL * m_pIdentMod->GetReadTimeout();
+
+	m_pIdentMod->AddAcceptedSocket(this);
+	m_pIdentMod->GetMetrics().accepted.Inc();
+}
+
+void CIdentAcceptedSocket::ReachedMaxBuffer()
+{
+	// CSocket's version tells the user about it, not worth it for a flood:
+	if(m_pIdentMod)
+	{
+		m_pIdentMod->GetMetrics().overlong.Inc();
+	}
+
+	m_bDone = true;
+	Close();
+}
+
+void CIdentAcceptedSocket::ReadLine(const CS_STRING & sLine)
+{
+	CIdentServerMod *pMod = reinterpret_cast<CIdentServerMod*>(m_pModule);
+
+	if(!m_bAddrsParsed)
+	{
+		// the local end isn't known before the accept finished, so do it here:
+		m_localAddr.Parse(GetLocalIP());
+		m_remoteAddr.Parse(GetRemoteIP());
+		m_bAddrsParsed = true;
+	}
+
+	CIdentServer *pServer = pMod->GetIdentServer();
+
+	if(m_bDone)
+	{
+		// more lines in the same read after we decided to close
+		return;
+	}
+
+	if(!pServer)
+	{
+		// the listener went away while this connection was open
+		m_bDone = true;
+		Close();
+		return;
+	}
+
+	CIdentReplyWriter Reply;
+	pServer->GetResponse(sLine, m_localAddr, m_remoteAddr, Reply);
+
+	if(!pMod->IsPipelined())
+	{
+		Write(Reply.GetData(), Reply.GetSize());
+
+		m_bDone = true;
+		Close(CLT_AFTERWRITE);
+		return;
+	}
+
+	m_sPending.append(Reply.GetData(), Reply.GetSize());
+	m_uQueries++;
+
+	const unsigned int uMaxQueries = pMod->GetPipelineMaxQueries();
+	if(uMaxQueries > 0 && m_uQueries >= uMaxQueries)
+	{
+		m_bDone = true;
+	}
+
+	// Csock has already taken this line out of the read buffer, so once
+	// there is no complete line left this read has been fully answered:
+	if(m_bDone || GetInternalReadBuffer().find('\n') == CString::npos)
+	{
+		Write(m_sPending);
+		m_sPending.clear();
+	}
+
+	if(m_bDone)
+	{
+		Close(CLT_AFTERWRITE);
+	}
+	else
+	{
+		// from now on it's an idle timeout, as on the Threaded listener:
+		m_uDeadlineMs = IdentNowMs() + 1000ULL * pMod->GetPipelineIdleTimeout();
+	}
+}
+
+void CIdentAcceptedSocket::ExpireIfIdle(uint64_t uNowMs)
+{
+	if(!m_bDone && m_uDeadlineMs <= uNowMs)
+	{
+		m_bDone = true;
+		Close();
+	}
+}
+
+CIdentAcceptedSocket::~CIdentAcceptedSocket()
+{
+	if(m_pIdentMod)
+	{
+		m_pIdentMod->RemoveAcceptedSocket(this);
+	}
+}
+
+
+/************************************************************************/
+/* CIdentMetricsListener method implementation section                  */
+/************************************************************************/
+
+Csock *CIdentMetricsListener::GetSockObj(const CS_STRING & sHostname, u_short uPort)
+{
+	return new CIdentMetricsSocket(m_pModule);
+}
+
+CIdentMetricsSocket::CIdentMetricsSocket(CModule *pMod) : CSocket(pMod)
+{
+	m_bGotRequestLine = false;
+	m_bDone = false;
+	EnableReadLine();
+
+	// a scrape is a request line and a few headers:
+	SetMaxBufferThreshold(4096);
+	SetTimeout(10, TMO_READ);
+}
+
+void CIdentMetricsSocket::ReachedMaxBuffer()
+{
+	m_bDone = true;
+	Close();
+}
+
+void CIdentMetricsSocket::ReadLine(const CS_STRING & sLine)
+{
+	const CString sTrimmed = sLine.TrimRight_n("\r\n");
+
+	if(m_bDone)
+	{
+		return;
+	}
+
+	if(!m_bGotRequestLine)
+	{
+		// empty lines before the request line are to be ignored (RFC 7230 3.5)
+		if(!sTrimmed.empty())
+		{
+			m_sMethod = sTrimmed.Token(0);
+			m_sPath = sTrimmed.Token(1).Token(0, false, "?");
+			m_bGotRequestLine = true;
+		}
+		return;
+	}
+
+	if(!sTrimmed.empty())
+	{
+		// a header, none of them change the answer
+		return;
+	}
+
+	if(m_sMethod != "GET" && m_sMethod != "HEAD")
+	{
+		Respond("405 Method Not Allowed", "Only GET is supported.\n");
+	}
+	else if(m_sPath != "/metrics" && m_sPath != "/")
+	{
+		Respond("404 Not Found", "Metrics are at /metrics.\n");
+	}
+	else
+	{
+		Respond("200 OK", reinterpret_cast<CIdentServerMod*>(m_pModule)->GetMetricsText());
+	}
+}
+
+void CIdentMetricsSocket::Respond(const CString& sStatus, const CString& sBody)
+{
+	Write("HTTP/1.0 " + sStatus + "\r\n"
+		"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		"Content-Length: " + CString((unsigned long long)sBody.size()) + "\r\n"
+		"Connection: close\r\n"
+		"\r\n");
+
+	if(m_sMethod != "HEAD")
+	{
+		Write(sBody);
+	}
+
+	m_bDone = true;
+	Close(CLT_AFTERWRITE);
+}
+
+
+/************************************************************************/
+/* CIdentServerMod method implementation section                        */
+/************************************************************************/
+
+const CIdentSetting *CIdentServerMod::FindSetting(const CString& sName)
+{
+	for(const CIdentSetting& setting : g_aSettings)
+	{
+		if(sName.Equals(setting.szName))
+			return &setting;
+	}
+
+	return NULL;
+}
+
+bool CIdentServerMod::ApplySetting(const CIdentSetting& setting, const CString& sValue, CString& sError)
+{
+	const CString sName = setting.szName;
+
+	if(sName == "Trace")
+	{
+		if(sValue.Equals("off") || sValue == "0")
+			m_eTraceLevel = TRACE_OFF;
+		else if(sValue.Equals("queries") || sValue == "1")
+			m_eTraceLevel = TRACE_QUERIES;
+		else if(sValue.Equals("candidates") || sValue.Equals("verbose") || sValue == "2")
+			m_eTraceLevel = TRACE_CANDIDATES;
+		else
+		{
+			sError = "Trace must be 0 (off), 1 (queries) or 2 (candidates)";
+			return false;
+		}
+	}
+	else if(sName == "Pipeline")
+	{
+		m_bPipeline = sValue.ToBool();
+	}
+	else if(sName == "PipelineMaxQueries")
+	{
+		if(!ParseUInt(sValue, m_uPipelineMaxQueries))
+		{
+			sError = "PipelineMaxQueries must be a number";
+			return false;
+		}
+	}
+	else if(sName == "PipelineIdleTimeout")
+	{
+		unsigned int uTimeout;
+		if(!ParseUInt(sValue, uTimeout) || uTimeout == 0)
+		{
+			sError = "PipelineIdleTimeout must be a number of seconds";
+			return false;
+		}
+		m_uPipelineIdleTimeout = uTimeout;
+	}
+	else if(sName == "MaxClients")
+	{
+		if(!ParseUInt(sValue, m_uMaxClients))
+		{
+			sError = "MaxClients must be a number";
+			return false;
+		}
+	}
+	else if(sName == "ReadTimeout")
+	{
+		unsigned int uTimeout;
+		if(!ParseUInt(sValue, uTimeout) || uTimeout == 0)
+		{
+			sError = "ReadTimeout must be a number of seconds";
+			return false;
+		}
+		m_uReadTimeout = uTimeout;
+	}
+	else if(sName == "MaxLineLength")
+	{
+		unsigned int uLength;
+		if(!ParseUInt(sValue, uLength) || uLength < 16)
+		{
+			sError = "MaxLineLength must be a number of at least 16";
+			return false;
+		}
+		m_uMaxLineLength = uLength;
+	}
+	else if(sName == "RateLimit")
+	{
+		if(!ParseUInt(sValue, m_uRateLimit))
+		{
+			sError = "RateLimit must be a number";
+			return false;
+		}
+		m_rateLimiter.SetRate(m_uRateLimit, m_uRateBurst);
+	}
+	else if(sName == "RateBurst")
+	{
+		unsigned int uBurst;
+		if(!ParseUInt(sValue, uBurst) || uBurst == 0)
+		{
+			sError = "RateBurst must be a number of at least 1";
+			return false;
+		}
+		m_uRateBurst = uBurst;
+		m_rateLimiter.SetRate(m_uRateLimit, m_uRateBurst);
+	}
+	else if(sName == "RateTableSize")
+	{
+		unsigned int uSize;
+		if(!ParseUInt(sValue, uSize) || uSize == 0 || uSize > 1048576)
+		{
+			sError = "RateTableSize must be a number between 1 and 1048576";
+			return false;
+		}
+		m_rateLimiter.SetCapacity(uSize);
+	}
+	else if(sName == "Persistent")
+	{
+		m_bPersistent = sValue.ToBool();
+
+		if(m_bPersistent)
+		{
+			// a failure shows up in STATUS, OnIRCConnecting tries again
+			StartIdentServer();
+		}
+		else
+		{
+			StopIdentServerIfUnused();
+		}
+	}
+	else if(sName == "Threaded")
+	{
+		const bool bThreaded = sValue.ToBool();
+
+		if(bThreaded != m_bThreaded)
+		{
+			const bool bWasListening = IsListening();
+
+			StopIdentServer();
+			m_bThreaded = bThreaded;
+			UpdateSnapshotPublishing();
+
+			if(bWasListening)
+			{
+				// a failure shows up in STATUS
+				StartIdentServer();
+			}
+		}
+	}
+	else if(sName == "Threads")
+	{
+		unsigned int uThreads;
+		if(!ParseUInt(sValue, uThreads) || uThreads == 0 || uThreads > 64)
+		{
+			sError = "Threads must be a number between 1 and 64";
+			return false;
+		}
+
+		if(uThreads != m_uThreads)
+		{
+			m_uThreads = uThreads;
+			if(m_bThreaded)
+			{
+				RestartIdentServer();
+			}
+		}
+	}
+	else if(sName == "ExportFile")
+	{
+		if(sValue != m_sExportFile)
+		{
+			m_sExportFile = sValue;
+			// a failure shows up in STATUS
+			RestartExport();
+		}
+	}
+	else if(sName == "ExportSlots")
+	{
+		unsigned int uSlots;
+		if(!ParseUInt(sValue, uSlots) || uSlots < 64 || uSlots > 1048576)
+		{
+			sError = "ExportSlots must be a number between 64 and 1048576";
+			return false;
+		}
+
+		if(uSlots != m_uExportSlots)
+		{
+			m_uExportSlots = uSlots;
+			if(!m_sExportFile.empty())
+			{
+				RestartExport();
+			}
+		}
+	}
+	else if(sName == "ListenHosts")
+	{
+		VCString vsHosts;
+		sValue.Replace_n(",", " ").Split(" ", vsHosts, false);
+
+		if(vsHosts != m_vsListenHosts)
+		{
+			m_vsListenHosts = vsHosts;
+			RestartIdentServer();
+		}
+	}
+	else if(sName == "ListenBacklog")
+	{
+		unsigned int uBacklog;
+		if(!ParseUInt(sValue, uBacklog) || uBacklog == 0 || uBacklog > 65535)
+		{
+			sError = "ListenBacklog must be a number between 1 and 65535";
+			return false;
+		}
+
+		if(uBacklog != m_uListenBacklog)
+		{
+			m_uListenBacklog = uBacklog;
+			RestartIdentServer();
+		}
+	}
+	else if(sName == "IdentService")
+	{
+		CString sHost;
+		unsigned int uPort = 0;
+
+		if(!sValue.empty())
+		{
+			const size_t uColon = sValue.rfind(':');
+
+			if(uColon == CString::npos || !ParseUInt(sValue.substr(uColon + 1), uPort) || uPort == 0 || uPort > 65535)
+			{
+				sError = "IdentService must be host:port, or empty";
+				return false;
+			}
+			// [::1]:port
+			sHost = CString(sValue.substr(0, uColon)).TrimPrefix_n("[").TrimSuffix_n("]");
+		}
+
+		if(sValue != m_sIdentService)
+		{
+			m_sIdentService = sValue;
+			m_sockIndex.SetSource(NULL);
+			delete m_pIdentService;
+			m_pIdentService = NULL;
+
+			if(!sHost.empty())
+			{
+				m_pIdentService = new CIdentServiceSource(this, sHost, (unsigned short)uPort);
+				m_sockIndex.SetSource(m_pIdentService);
+			}
+			m_sockIndex.InvalidateIdents();
+		}
+	}
+	else if(sName == "KernelLookup")
+	{
+		m_bKernelLookup = sValue.ToBool();
+		m_sockDiag.Close();
+		m_socketInodes.clear();
+		m_tInodesWalked = 0;
+
+		if(m_bKernelLookup)
+		{
+			std::string sDiagError;
+			if(!m_sockDiag.Open(sDiagError))
+			{
+				// a failure shows up in STATUS
+				DEBUG("WARNING: KernelLookup: " << sDiagError);
+			}
+		}
+	}
+	else if(sName == "KernelLookupRate")
+	{
+		unsigned int uRate;
+		if(!ParseUInt(sValue, uRate))
+		{
+			sError = "KernelLookupRate must be a number";
+			return false;
+		}
+		m_sockDiag.SetRate(uRate);
+	}
+	else if(sName == "ConnectWindow")
+	{
+		if(!ParseUInt(sValue, m_uConnectWindow))
+		{
+			sError = "ConnectWindow must be a number";
+			return false;
+		}
+	}
+	else if(sName == "AnswerWindow")
+	{
+		if(!ParseUInt(sValue, m_uAnswerWindow))
+		{
+			sError = "AnswerWindow must be a number of seconds";
+			return false;
+		}
+	}
+	else if(sName == "MetricsHost")
+	{
+		m_sMetricsHost = sValue;
+		RestartMetricsListener();
+	}
+	else if(sName == "MetricsPort")
+	{
+		unsigned int uPort;
+		if(!ParseUInt(sValue, uPort) || uPort > 65535)
+		{
+			sError = "MetricsPort must be a port number, or 0 for off";
+			return false;
+		}
+		m_uMetricsPort = (unsigned short)uPort;
+		RestartMetricsListener();
+	}
+
+	ConfigureThreadServer();
+
+	return true;
+}
+
+bool CIdentServerMod::ParseUInt(const CString& sValue, unsigned int& uValue)
+{
+	if(sValue.empty() || sValue.size() > 9 || sValue.find_first_not_of("0123456789") != CString::npos)
+		return false;
+
+	uValue = sValue.ToUInt();
+	return true;
+}
+
+CString CIdentServerMod::GetSetting(const CIdentSetting& setting) const
+{
+	const CString sName = setting.szName;
+
+	if(sName == "Trace")
+		return CString((unsigned int)m_eTraceLevel);
+	if(sName == "Pipeline")
+		return CString(m_bPipeline);
+	if(sName == "PipelineMaxQueries")
+		return CString(m_uPipelineMaxQueries);
+	if(sName == "PipelineIdleTimeout")
+		return CString(m_uPipelineIdleTimeout);
+	if(sName == "MaxClients")
+		return CString(m_uMaxClients);
+	if(sName == "ReadTimeout")
+		return CString(m_uReadTimeout);
+	if(sName == "MaxLineLength")
+		return CString(m_uMaxLineLength);
+	if(sName == "RateLimit")
+		return CString(m_uRateLimit);
+	if(sName == "RateBurst")
+		return CString(m_uRateBurst);
+	if(sName == "Persistent")
+		return CString(m_bPersistent);
+	if(sName == "Threaded")
+		return CString(m_bThreaded);
+	if(sName == "Threads")
+		return CString(m_uThreads);
+	if(sName == "ExportFile")
+		return m_sExportFile;
+	if(sName == "ExportSlots")
+		return CString(m_uExportSlots);
+	if(sName == "ListenHosts")
+	{
+		CString sHosts;
+		for(const CString& sHost : m_vsListenHosts)
+			sHosts += (sHosts.empty() ? "" : " ") + sHost;
+		return sHosts;
+	}
+	if(sName == "ListenBacklog")
+		return CString(m_uListenBacklog);
+	if(sName == "IdentService")
+		return m_sIdentService;
+	if(sName == "KernelLookup")
+		return CString(m_bKernelLookup);
+	if(sName == "KernelLookupRate")
+		return CString(m_sockDiag.GetRate());
+	if(sName == "AnswerWindow")
+		return CString(m_uAnswerWindow);
+	if(sName == "ConnectWindow")
+		return CString(m_uConnectWindow);
+	if(sName == "RateTableSize")
+		return CString((unsigned long long)m_rateLimiter.GetCapacity());
+	if(sName == "MetricsHost")
+		return m_sMetricsHost;
+	if(sName == "MetricsPort")
+		return CString(m_uMetricsPort);
+
+	return "";
+}
+
+bool CIdentServerMod::OnLoad(const CString& sArgs, CString& sMessage)
+{
+	// saved settings first, module arguments override them:
+	for(const CIdentSetting& setting : g_aSettings)
+	{
+		const CString sValue = GetNV(setting.szName);
+		CString sError;
+
+		if(!sValue.empty() && !ApplySetting(setting, sValue, sError))
+		{
+			DEBUG("identserv: ignoring saved setting " << setting.szName << ": " << sError);
+		}
+	}
+
+	VCString vsArgs;
+	sArgs.Split(" ", vsArgs, false);
+
+	for(const CString& sArg : vsArgs)
+	{
+		const CIdentSetting *pSetting = FindSetting(sArg.Token(0, false, "="));
+
+		if(!pSetting)
+		{
+			sMessage = "Unknown setting [" + sArg.Token(0, false, "=") + "]";
+			return false;
+		}
+
+		if(!ApplySetting(*pSetting, sArg.Token(1, true, "="), sMessage))
+		{
+			return false;
+		}
+	}
+
+	// with all settings in place, the listener doesn't get opened and
+	// closed again for every one of them:
+	m_bLoaded = true;
+
+	// reloaded or loaded late, networks may be up or connecting already:
+	BuildIndex();
+	AddTimer(new CIdentConsistencyTimer(this));
+
+	if(m_bPersistent)
+	{
+		// a failure shows up in STATUS, OnIRCConnecting tries again
+		StartIdentServer();
+	}
+
+	return true;
+}
+
+CIdentServerMod::EModRet CIdentServerMod::OnIRCConnecting(CIRCSock *pIRCSock)
+{
+	assert(m_pNetwork != NULL);
+
+	DEBUG("CIdentServerMod::OnIRCConnecting");
+
+	if(!TakeConnectSlot(m_pNetwork))
+	{
+		// CIRCNetwork::Connect puts the network back into ZNC's connect queue.
+		// ZNC 1.6 also tells the network's clients "Some module aborted the
+		// connection attempt" and moves on to the next server in the list.
+		return HALT;
+	}
+
+	// reconnecting, it's a regular active network again:
+	m_answerWindows.erase(m_pNetwork);
+
+	const CString sName = m_pNetwork->GetUser()->GetUserName() + "/" + m_pNetwork->GetName();
+	m_connectTimings[m_pNetwork].Start(sName.data(), sName.size(), IdentNowNs());
+
+	// long before the server asks, the TCP connect hasn't even started:
+	m_sockIndex.GetSource().Prefetch(m_pNetwork);
+
+	// indexed at OnIRCRegistration, the consistency check retries until then
+	m_dirtyNetworks.Insert(m_pNetwork);
+
+	if(!StartIdentServer())
+	{
+		return CONTINUE;
+	}
+
+	IncreaseUseCount(m_pNetwork);
+
+	return CONTINUE;
+}
+
+bool CIdentServerMod::TakeConnectSlot(CIRCNetwork *pNetwork)
+{
+	if(m_uConnectWindow == 0 || m_connectSlots.count(pNetwork))
+	{
+		return true;
+	}
+
+	const CServer *pServer = pNetwork->GetCurrentServer();
+	if(!pServer)
+	{
+		return true;
+	}
+
+	const CString sServer = pServer->GetName() + " " + CString(pServer->GetPort());
+	unsigned int& uConnecting = m_connectingPerServer[sServer];
+
+	if(!m_pConnectSlotTimer)
+	{
+		m_pConnectSlotTimer = new CIdentConnectSlotTimer(this);
+		AddTimer(m_pConnectSlotTimer);
+	}
+
+	if(uConnecting >= m_uConnectWindow)
+	{
+		m_heldBack.insert(pNetwork);
+		m_metrics.heldBack.Inc();
+		return false;
+	}
+
+	uConnecting++;
+	CIdentConnectSlot& slot = m_connectSlots[pNetwork];
+	slot.sServer = sServer;
+	slot.tTaken = time(NULL);
+	m_heldBack.erase(pNetwork);
+
+	return true;
+}
+
+void CIdentServerMod::ReleaseConnectSlot(CIRCNetwork *pNetwork)
+{
+	// not touching m_heldBack: OnIRCConnectionError also fires for the
+	// attempts we held back ourselves
+
+	auto it = m_connectSlots.find(pNetwork);
+	if(it == m_connectSlots.end())
+	{
+		return;
+	}
+
+	auto itServer = m_connectingPerServer.find(it->second.sServer);
+	if(itServer != m_connectingPerServer.end() && --itServer->second == 0)
+	{
+		m_connectingPerServer.erase(itServer);
+	}
+
+	m_connectSlots.erase(it);
+}
+
+void CIdentServerMod::ExpireConnectSlots()
+{
+	// well past ZNC's 120 second connect timeout and a slow registration
+	const time_t CONNECT_SLOT_TIMEOUT = 300;
+	const time_t tNow = time(NULL);
+	std::vector<CIRCNetwork*> vExpired;
+
+	for(const auto& it : m_connectSlots)
+	{
+		// e.g. a module after us returned HALT from OnIRCConnecting, and the
+		// OnIRCConnectionError that should have come with it didn't:
+		if(!it.first->GetIRCSock() || tNow - it.second.tTaken >= CONNECT_SLOT_TIMEOUT)
+		{
+			vExpired.push_back(it.first);
+		}
+	}
+
+	for(CIRCNetwork *pNetwork : vExpired)
+	{
+		ReleaseConnectSlot(pNetwork);
+	}
+
+	for(auto it = m_heldBack.begin(); it != m_heldBack.end(); )
+	{
+		// disabled networks leave ZNC's connect queue without a word to us
+		if(m_uConnectWindow == 0 || !(*it)->GetIRCConnectEnabled() || (*it)->GetIRCSock())
+			it = m_heldBack.erase(it);
+		else
+			++it;
+	}
+}
+
+void CIdentServerMod::RestartMetricsListener()
+{
+	if(m_pMetricsListener)
+	{
+		// right away, a new host on the same port binds it below (see StopIdentServer)
+		GetManager()->DelSockByAddr(m_pMetricsListener);
+		m_pMetricsListener = NULL;
+	}
+
+	m_metricsListenFailed = false;
+
+	if(m_uMetricsPort == 0)
+	{
+		return;
+	}
+
+	m_pMetricsListener = new CIdentMetricsListener(this);
+
+	const bool bListening = m_sMetricsHost.empty() ?
+		GetManager()->ListenAll(m_uMetricsPort, "IDENT_METRICS", false, SOMAXCONN, m_pMetricsListener) :
+		GetManager()->ListenHost(m_uMetricsPort, "IDENT_METRICS", m_sMetricsHost, false, SOMAXCONN, m_pMetricsListener);
+
+	if(!bListening)
+	{
+		DEBUG("WARNING: Opening the metrics listening socket failed!");
+		m_metricsListenFailed = true;
+		m_pMetricsListener = NULL; /* Csock deleted the instance, like in StartIdentServer. */
+	}
+}
+
+static void AppendMetricHeader(CString& sOut, const char *szName, const char *szType, const char *szHelp)
+{
+	sOut += CString("# HELP ") + szName + " " + szHelp + "\n";
+	sOut += CString("# TYPE ") + szName + " " + szType + "\n";
+}
+
+static void AppendMetric(CString& sOut, const CString& sName, uint64_t uValue)
+{
+	sOut += sName + " " + CString((unsigned long long)uValue) + "\n";
+}
+
+static CString FormatSeconds(uint64_t uNs)
+{
+	char szBuf[32];
+	snprintf(szBuf, sizeof(szBuf), "%.9g", uNs / 1e9);
+	return szBuf;
+}
+
+CString CIdentServerMod::GetMetricsText()
+{
+	const CIdentMetrics& m = m_metrics;
+	CString sOut;
+
+	AppendMetricHeader(sOut, "identserv_queries_total", "counter", "IDENT requests handled.");
+	AppendMetric(sOut, "identserv_queries_total", m.queries.Get());
+
+	AppendMetricHeader(sOut, "identserv_replies_total", "counter", "IDENT replies sent, by result.");
+	AppendMetric(sOut, "identserv_replies_total{result=\"userid\"}", m.replyUserId.Get());
+	AppendMetric(sOut, "identserv_replies_total{result=\"no-user\"}", m.replyNoUser.Get());
+	AppendMetric(sOut, "identserv_replies_total{result=\"invalid-port\"}", m.replyInvalidPort.Get());
+
+	AppendMetricHeader(sOut, "identserv_matches_total", "counter", "USERID replies, by how the IRC connection was matched.");
+	AppendMetric(sOut, "identserv_matches_total{kind=\"exact\"}", m.exactMatches.Get());
+	AppendMetric(sOut, "identserv_matches_total{kind=\"fallback\"}", m.fallbackMatches.Get());
+
+	AppendMetricHeader(sOut, "identserv_index_hits_total", "counter", "Requests answered from the socket index.");
+	AppendMetric(sOut, "identserv_index_hits_total", m.indexHits.Get());
+
+	AppendMetricHeader(sOut, "identserv_scans_total", "counter", "Requests that missed the index and looked at the networks not indexed yet.");
+	AppendMetric(sOut, "identserv_scans_total", m.scans.Get());
+
+	AppendMetricHeader(sOut, "identserv_scanned_networks_total", "counter", "Networks looked at by those scans.");
+	AppendMetric(sOut, "identserv_scanned_networks_total", m.scannedNetworks.Get());
+
+	AppendMetricHeader(sOut, "identserv_kernel_lookups_total", "counter", "KernelLookup requests to the kernel's TCP table.");
+	AppendMetric(sOut, "identserv_kernel_lookups_total", m.kernelLookups.Get());
+
+	AppendMetricHeader(sOut, "identserv_kernel_hits_total", "counter", "KernelLookup requests that found an IRC connection.");
+	AppendMetric(sOut, "identserv_kernel_hits_total", m.kernelHits.Get());
+
+	AppendMetricHeader(sOut, "identserv_kernel_lookups_skipped_total", "counter", "KernelLookup requests not made because KernelLookupRate was used up.");
+	AppendMetric(sOut, "identserv_kernel_lookups_skipped_total", m_sockDiag.GetSkipped());
+
+	AppendMetricHeader(sOut, "identserv_consistency_checked_networks_total", "counter", "Networks the periodic consistency check compared with the socket index.");
+	AppendMetric(sOut, "identserv_consistency_checked_networks_total", m.checkedNetworks.Get());
+
+	AppendMetricHeader(sOut, "identserv_consistency_repaired_networks_total", "counter", "Networks it found out of date and fixed.");
+	AppendMetric(sOut, "identserv_consistency_repaired_networks_total", m.repairedNetworks.Get());
+
+	AppendMetricHeader(sOut, "identserv_accepted_connections_total", "counter", "IDENT connections accepted.");
+	AppendMetric(sOut, "identserv_accepted_connections_total", m.accepted.Get());
+
+	AppendMetricHeader(sOut, "identserv_rejected_connections_total", "counter", "IDENT connections refused or closed early, by reason.");
+	AppendMetric(sOut, "identserv_rejected_connections_total{reason=\"max_clients\"}", m.refused.Get());
+	AppendMetric(sOut, "identserv_rejected_connections_total{reason=\"rate_limited\"}", m.rateLimited.Get());
+	AppendMetric(sOut, "identserv_rejected_connections_total{reason=\"overlong_line\"}", m.overlong.Get());
+
+	AppendMetricHeader(sOut, "identserv_held_back_connects_total", "counter", "IRC connection attempts sent back to the connect queue by ConnectWindow.");
+	AppendMetric(sOut, "identserv_held_back_connects_total", m.heldBack.Get());
+
+	// buckets below 128ns only hold clock noise, fold them into the first one:
+	AppendMetricHeader(sOut, "identserv_lookup_duration_seconds", "histogram", "Time from request line to formatted reply.");
+	uint64_t uCumulative = 0;
+	for(unsigned int uBucket = 0; uBucket < CIdentLatencyHistogram::BUCKETS - 1; uBucket++)
+	{
+		uCumulative += m.lookupLatency.GetBucket(uBucket);
+		if(uBucket >= 7)
+		{
+			AppendMetric(sOut, "identserv_lookup_duration_seconds_bucket{le=\"" + FormatSeconds(CIdentLatencyHistogram::GetBucketLimitNs(uBucket)) + "\"}", uCumulative);
+		}
+	}
+	uCumulative += m.lookupLatency.GetBucket(CIdentLatencyHistogram::BUCKETS - 1);
+	AppendMetric(sOut, "identserv_lookup_duration_seconds_bucket{le=\"+Inf\"}", uCumulative);
+	sOut += "identserv_lookup_duration_seconds_sum " + FormatSeconds(m.lookupLatency.GetSumNs()) + "\n";
+	AppendMetric(sOut, "identserv_lookup_duration_seconds_count", uCumulative);
+
+	AppendMetricHeader(sOut, "identserv_listening", "gauge", "Whether the IDENT port is open.");
+	AppendMetric(sOut, "identserv_listening", IsListening() ? 1 : 0);
+
+	AppendMetricHeader(sOut, "identserv_answering_networks", "gauge", "Networks IDENT requests are currently answered for.");
+	AppendMetric(sOut, "identserv_answering_networks", m_activeUsers.GetSize());
+
+	AppendMetricHeader(sOut, "identserv_answer_window_networks", "gauge", "Connected networks still in their AnswerWindow.");
+	AppendMetric(sOut, "identserv_answer_window_networks", m_answerWindows.size());
+
+	AppendMetricHeader(sOut, "identserv_indexed_sockets", "gauge", "IRC connections in the socket index.");
+	AppendMetric(sOut, "identserv_indexed_sockets", m_sockIndex.GetSize());
+
+	AppendMetricHeader(sOut, "identserv_indexed_local_addresses", "gauge", "Local addresses the indexed IRC connections were made from.");
+	AppendMetric(sOut, "identserv_indexed_local_addresses", m_sockIndex.GetPartitionCount());
+
+	if(m_exportTable.IsOpen())
+	{
+		AppendMetricHeader(sOut, "identserv_export_used_slots", "gauge", "Connections in the ExportFile.");
+		AppendMetric(sOut, "identserv_export_used_slots", m_exportTable.GetUsed());
+	}
+
+	AppendMetricHeader(sOut, "identserv_open_connections", "gauge", "IDENT connections currently open.");
+	AppendMetric(sOut, "identserv_open_connections", GetAcceptedSocketCount() + (m_pThreadServer ? m_pThreadServer->GetOpenConnections() : 0));
+
+	AppendMetricHeader(sOut, "identserv_connecting_networks", "gauge", "Networks holding a ConnectWindow slot.");
+	AppendMetric(sOut, "identserv_connecting_networks", m_connectSlots.size());
+
+	AppendMetricHeader(sOut, "identserv_held_back_networks", "gauge", "Networks waiting in the connect queue for a ConnectWindow slot.");
+	AppendMetric(sOut, "identserv_held_back_networks", m_heldBack.size());
+
+	return sOut;
+}
+
+bool CIdentServerMod::StartIdentServer()
+{
+	if(!m_bLoaded)
+	{
+		return false;
+	}
+
+	if(m_bThreaded)
+	{
+		if(!m_pThreadServer)
+		{
+			m_pThreadServer = new CIdentThreadServer(m_snapshotPublisher.GetSnapshot(), m_history, m_metrics);
+		}
+
+		if(m_pThreadServer->IsRunning())
+		{
+			return true;
+		}
+
+		DEBUG("Starting up IDENT listener thread.");
+		ConfigureThreadServer();
+
+		const std::vector<std::string> vsBindHosts(m_vsListenHosts.begin(), m_vsListenHosts.end());
+		std::string sError;
+		if(!m_pThreadServer->Start(vsBindHosts, m_serverPort, m_uThreads, m_uListenBacklog, sError))
+		{
+			DEBUG("WARNING: Opening the listening socket failed: " << sError);
+			m_listenFailed = true;
+			return false;
+		}
+
+		m_listenFailed = false;
+		return true;
+	}
+
+	if(!m_vIdentServers.empty())
+	{
+		return true;
+	}
+
+	DEBUG("Starting up IDENT listener.");
+
+	// an address that can't be listened on doesn't keep the others closed:
+	const VCString vsBindHosts = m_vsListenHosts.empty() ? VCString(1, "") : m_vsListenHosts;
+	m_listenFailed = false;
+
+	for(const CString& sBindHost : vsBindHosts)
+	{
+		CIdentServer *pServer = new CIdentServer(this, m_serverPort, sBindHost);
+
+		if(!pServer->StartListening(m_uListenBacklog))
+		{
+			DEBUG("WARNING: Opening the listening socket on [" << (sBindHost.empty() ? CString("*") : sBindHost) << "] failed!");
+			m_listenFailed = true;
+			continue; /* Csock deleted the instance. (gross) */
+		}
+
+		m_vIdentServers.push_back(pServer);
+	}
+
+	return !m_vIdentServers.empty();
+}
+
+void CIdentServerMod::StopIdentServer()
+{
+	if(!m_vIdentServers.empty())
+	{
+		DEBUG("Closing down IDENT listener.");
+		for(CIdentServer *pServer : m_vIdentServers)
+		{
+			// Close() would only free the port on the next pass of the
+			// socket loop, too late for a restart that binds it right away
+			GetManager()->DelSockByAddr(pServer);
+		}
+		m_vIdentServers.clear();
+	}
+
+	if(m_pThreadServer && m_pThreadServer->IsRunning())
+	{
+		DEBUG("Stopping IDENT listener thread.");
+		m_pThreadServer->Stop();
+	}
+}
+
+void CIdentServerMod::StopIdentServerIfUnused()
+{
+	// in persistent mode the use count only decides whether we answer:
+	if(!InUse() && !m_bPersistent)
+	{
+		StopIdentServer();
+	}
+}
+
+void CIdentServerMod::RestartIdentServer()
+{
+	if(IsListening())
+	{
+		StopIdentServer();
+		// a failure shows up in STATUS, OnIRCConnecting tries again
+		StartIdentServer();
+	}
+}
+
+bool CIdentServerMod::IsListening() const
+{
+	return !m_vIdentServers.empty() || (m_pThreadServer && m_pThreadServer->IsRunning());
+}
+
+void CIdentServerMod::ConfigureThreadServer()
+{
+	if(!m_pThreadServer)
+	{
+		return;
+	}
+
+	m_pThreadServer->SetAnswering(InUse());
+	m_pThreadServer->SetLimits(m_uMaxClients, m_uReadTimeout, m_uMaxLineLength);
+	m_pThreadServer->SetPipeline(m_bPipeline, m_uPipelineMaxQueries, m_uPipelineIdleTimeout);
+	m_pThreadServer->SetRateLimit(m_uRateLimit, m_uRateBurst, m_rateLimiter.GetCapacity());
+}
+
+void CIdentServerMod::UpdateSnapshotPublishing()
+{
+	m_snapshotPublisher.BeginBatch();
+
+	m_sockIndex.SetPublisher(NULL);
+	m_snapshotPublisher.Clear();
+
+	if(m_bThreaded)
+	{
+		m_sockIndex.SetPublisher(&m_snapshotPublisher);
+		StartRefreshTimer();
+	}
+
+	m_snapshotPublisher.EndBatch();
+}
+
+void CIdentServerMod::RestartExport()
+{
+	m_sockIndex.SetExport(NULL);
+	m_exportTable.Close();
+	m_exportFailed = false;
+
+	if(m_sExportFile.empty())
+	{
+		return;
+	}
+
+	const CString sPath = m_sExportFile[0] == '/' ? m_sExportFile : CZNC::Get().GetZNCPath() + "/" + m_sExportFile;
+	std::string sError;
+
+	if(!m_exportTable.Open(sPath, m_uExportSlots, sError))
+	{
+		DEBUG("WARNING: Creating the export file failed: " << sError);
+		m_exportFailed = true;
+		return;
+	}
+
+	m_sockIndex.SetExport(&m_exportTable);
+	StartRefreshTimer();
+}
+
+void CIdentServerMod::AddSocketInode(CIRCNetwork *pNetwork)
+{
+	CIRCSock *pSock = pNetwork->GetIRCSock();
+	uint64_t uInode;
+
+	if(pSock && CIdentSockDiag::GetSocketInode(pSock->GetRSock(), uInode))
+	{
+		m_socketInodes[uInode] = pNetwork;
+	}
+}
+
+CIRCNetwork *CIdentServerMod::FindNetworkByKernel(const CIdentAddr& localAddr, unsigned short uLocalPort, const CIdentAddr& remoteAddr, unsigned short uRemotePort)
+{
+	uint64_t uInode;
+
+	if(!m_sockDiag.TakeToken())
+	{
+		// a flood of queries that miss the index mustn't stall the main loop
+		return NULL;
+	}
+
+	m_metrics.kernelLookups.Inc();
+
+	if(!m_sockDiag.Lookup(localAddr, uLocalPort, remoteAddr, uRemotePort, uInode))
+	{
+		// no such connection here, e.g. the ports were rewritten by NAT on the way
+		return NULL;
+	}
+
+	for(int iTry = 0; iTry < 2; iTry++)
+	{
+		auto it = m_socketInodes.find(uInode);
+
+		if(it != m_socketInodes.end())
+		{
+			CIRCSock *pSock = it->second->GetIRCSock();
+			uint64_t uSockInode;
+
+			// inode numbers get reused, make sure it's still that network's socket:
+			if(pSock && CIdentSockDiag::GetSocketInode(pSock->GetRSock(), uSockInode) && uSockInode == uInode)
+			{
+				m_metrics.kernelHits.Inc();
+				return it->second;
+			}
+
+			m_socketInodes.erase(it);
+		}
+
+		// connected before KernelLookup was turned on, or somebody else's
+		// socket. Look at all networks, but at most once a second:
+		const time_t tNow = time(NULL);
+		if(iTry > 0 || tNow == m_tInodesWalked)
+		{
+			break;
+		}
+
+		m_tInodesWalked = tNow;
+		m_socketInodes.clear();
+
+		for(const auto& user : CZNC::Get().GetUserMap())
+		{
+			for(CIRCNetwork *pNetwork : user.second->GetNetworks())
+			{
+				AddSocketInode(pNetwork);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void CIdentServerMod::StartRefreshTimer()
+{
+	if(!m_pRefreshTimer)
+	{
+		m_uRefreshedGeneration = m_sockIndex.GetIdentGeneration();
+		m_uNextIdentCheckNs = IdentNowNs() + CIdentSockIndex::IDENT_RECHECK_NS;
+		m_pRefreshTimer = new CIdentRefreshTimer(this);
+		AddTimer(m_pRefreshTimer);
+	}
+}
+
+void CIdentServerMod::RefreshIdents()
+{
+	if(!m_bThreaded && !m_exportTable.IsOpen())
+	{
+		return;
+	}
+
+	// bumped by InvalidateIdents; changes nobody told us about are looked
+	// for every IDENT_RECHECK_NS:
+	const uint32_t uGeneration = m_sockIndex.GetIdentGeneration();
+	const uint64_t uNowNs = IdentNowNs();
+
+	if(uGeneration == m_uRefreshedGeneration && uNowNs < m_uNextIdentCheckNs)
+	{
+		return;
+	}
+
+	// unchanged idents publish and write nothing:
+	if(m_bThreaded)
+	{
+		m_snapshotPublisher.Refresh([this](const CIRCNetwork *pNetwork) { return m_sockIndex.FormatUserIdText(pNetwork); });
+	}
+
+	m_sockIndex.RefreshExport();
+	m_uRefreshedGeneration = uGeneration;
+	m_uNextIdentCheckNs = uNowNs + CIdentSockIndex::IDENT_RECHECK_NS;
+}
+
+void CIdentServerMod::BuildIndex()
+{
+	// one publish for all of them:
+	m_snapshotPublisher.BeginBatch();
+
+	for(const auto& user : CZNC::Get().GetUserMap())
+	{
+		for(CIRCNetwork *pNetwork : user.second->GetNetworks())
+		{
+			CheckNetwork(pNetwork);
+		}
+	}
+
+	m_snapshotPublisher.EndBatch();
+}
+
+/**
+* Brings what the module knows about one network in line with its socket,
+* returns true if something had to change.
+**/
+bool CIdentServerMod::CheckNetwork(CIRCNetwork *pNetwork)
+{
+	CIRCSock *pSock = pNetwork->GetIRCSock();
+
+	if(!pSock)
+	{
+		m_dirtyNetworks.Erase(pNetwork);
+
+		// a disconnect we didn't see
+		return m_sockIndex.Contains(pNetwork) && m_sockIndex.Remove(pNetwork);
+	}
+
+	bool bChanged = false;
+
+	if(!pNetwork->IsIRCConnected() && !m_activeUsers.Contains(pNetwork))
+	{
+		// connecting since before the module was loaded
+		if(StartIdentServer())
+		{
+			IncreaseUseCount(pNetwork);
+			bChanged = true;
+		}
+	}
+
+	if(!pSock->IsConnected())
+	{
+		// the TCP connect is still going, nothing to index yet
+		m_dirtyNetworks.Insert(pNetwork);
+		return bChanged;
+	}
+
+	m_dirtyNetworks.Erase(pNetwork);
+
+	CIdentAddr localAddr, remoteAddr;
+	bool bExact;
+
+	if(localAddr.Parse(pSock->GetLocalIP()) && remoteAddr.Parse(pSock->GetRemoteIP()))
+	{
+		const CIdentSockIndex::CEntry *pEntry = m_sockIndex.FindEntry(localAddr, pSock->GetLocalPort(), pSock->GetRemotePort(), remoteAddr, bExact);
+
+		if(pEntry && bExact && pEntry->pNetwork == pNetwork)
+		{
+			return bChanged;
+		}
+	}
+
+	// missing or under an old address; Add also drops it if it can't be indexed
+	const bool bWasIndexed = m_sockIndex.Contains(pNetwork);
+	return m_sockIndex.Add(pNetwork) || bWasIndexed || bChanged;
+}
+
+/**
+* Every dirty network, then the next CHECK_SLICE of all of them in user
+* map order. A full pass over many thousands of networks takes a while,
+* but no tick costs more than a few dozen lookups.
+**/
+void CIdentServerMod::CheckConsistency()
+{
+	std::vector<CIRCNetwork*> vDirty;
+	m_dirtyNetworks.ForEach([&vDirty](CIRCNetwork *pNetwork) { vDirty.push_back(pNetwork); });
+
+	m_snapshotPublisher.BeginBatch();
+
+	for(CIRCNetwork *pNetwork : vDirty)
+	{
+		if(CheckNetwork(pNetwork))
+			m_metrics.repairedNetworks.Inc();
+	}
+
+	const std::map<CString, CUser*>& users = CZNC::Get().GetUserMap();
+	auto itu = users.lower_bound(m_sCheckUser);
+	size_t uChecked = 0;
+
+	if(itu != users.end() && itu->first != m_sCheckUser)
+	{
+		// that user was deleted, carry on with the next one
+		m_uCheckNetwork = 0;
+	}
+
+	while(itu != users.end() && uChecked < CHECK_SLICE)
+	{
+		const std::vector<CIRCNetwork*>& vNetworks = itu->second->GetNetworks();
+
+		while(m_uCheckNetwork < vNetworks.size() && uChecked < CHECK_SLICE)
+		{
+			if(CheckNetwork(vNetworks[m_uCheckNetwork++]))
+				m_metrics.repairedNetworks.Inc();
+			uChecked++;
+		}
+
+		if(m_uCheckNetwork >= vNetworks.size())
+		{
+			++itu;
+			m_uCheckNetwork = 0;
+		}
+	}
+
+	m_sCheckUser = itu != users.end() ? itu->first : CString();
+
+	m_snapshotPublisher.EndBatch();
+	m_metrics.checkedNetworks.Inc(uChecked + vDirty.size());
+}
+
+void CIdentServerMod::AddIdentTiming(CIRCNetwork *pNetwork, uint64_t uStartNs, uint64_t uEndNs)
+{
+	if(m_connectTimings.empty())
+	{
+		return;
+	}
+
+	auto it = m_connectTimings.find(pNetwork);
+
+	if(it != m_connectTimings.end())
+	{
+		it->second.AddQuery(uStartNs, uEndNs);
+	}
+}
+
+void CIdentServerMod::FinishConnectTiming(CIRCNetwork *pNetwork, bool bConnected)
+{
+	auto it = m_connectTimings.find(pNetwork);
+
+	if(it == m_connectTimings.end())
+	{
+		return;
+	}
+
+	if(bConnected)
+	{
+		it->second.uConnectedNs = IdentNowNs();
+	}
+
+	m_timingLog.Add(it->second);
+	m_connectTimings.erase(it);
+}
+
+bool CIdentServerMod::IncreaseUseCount(CIRCNetwork *pNetwork)
+{
+	const bool bAdded = m_activeUsers.Insert(pNetwork);
+
+	if(m_pThreadServer)
+	{
+		m_pThreadServer->SetAnswering(InUse());
+	}
+
+	return bAdded;
+}
+
+bool CIdentServerMod::DecreaseUseCount(CIRCNetwork *pNetwork)
+{
+	const bool bRemoved = m_activeUsers.Erase(pNetwork);
+
+	if(m_pThreadServer)
+	{
+		m_pThreadServer->SetAnswering(InUse());
+	}
+
+	return bRemoved;
+}
+
+size_t CIdentServerMod::DecreaseUseCount(const std::vector<CIRCNetwork*>& vNetworks)
+{
+	size_t uRemoved = 0;
+
+	for(CIRCNetwork *pNetwork : vNetworks)
+	{
+		uRemoved += m_activeUsers.Erase(pNetwork);
+	}
+
+	if(m_pThreadServer)
+	{
+		m_pThreadServer->SetAnswering(InUse());
+	}
+
+	return uRemoved;
+}
+
+CIdentServerMod::EModRet CIdentServerMod::OnIRCRegistration(CString& sPass, CString& sNick, CString& sIdent, CString& sRealName)
+{
+	// OnIRCConnecting fires before the TCP connect, this is the first
+	// point where the socket's local and remote ports are known:
+	if(m_sockIndex.Add(m_pNetwork))
+	{
+		m_dirtyNetworks.Erase(m_pNetwork);
+	}
+
+	if(m_sockDiag.IsOpen())
+	{
+		AddSocketInode(m_pNetwork);
+	}
+
+	return CONTINUE;
+}
+
+void CIdentServerMod::OnIRCConnectionError(CIRCSock *pIRCSock)
+{
+	m_sockIndex.Remove(m_pNetwork);
+	m_dirtyNetworks.Erase(m_pNetwork);
+	ReleaseConnectSlot(m_pNetwork);
+	FinishConnectTiming(m_pNetwork, false);
+}
+
+void CIdentServerMod::NoLongerNeedsIdentServer()
 {
 	assert(m_pNetwork != NULL);
 
-	if(m_identServer)
+	DecreaseUseCount(m_pNetwork);
+	StopIdentServerIfUnused();
+}
+
+void CIdentServerMod::NoLongerNeedsIdentServer(const std::vector<CIRCNetwork*>& vNetworks)
+{
+	// one decision about the listener for all of them:
+	if(DecreaseUseCount(vNetworks) > 0)
+	{
+		StopIdentServerIfUnused();
+	}
+}
+
+void CIdentServerMod::ForgetNetworks(const std::vector<CIRCNetwork*>& vNetworks)
+{
+	for(CIRCNetwork *pNetwork : vNetworks)
+	{
+		m_sockIndex.Remove(pNetwork);
+		m_answerWindows.erase(pNetwork);
+		ReleaseConnectSlot(pNetwork);
+		m_heldBack.erase(pNetwork);
+		m_sockIndex.GetSource().Forget(pNetwork);
+		m_connectTimings.erase(pNetwork);
+		m_dirtyNetworks.Erase(pNetwork);
+	}
+
+	if(!m_socketInodes.empty())
 	{
-		m_identServer->DecreaseUseCount(m_pNetwork);
+		TIdentPtrSet<CIRCNetwork> forgotten;
+		for(CIRCNetwork *pNetwork : vNetworks)
+			forgotten.Insert(pNetwork);
 
-		if(!m_identServer->InUse())
+		for(auto it = m_socketInodes.begin(); it != m_socketInodes.end(); )
 		{
-			DEBUG("Closing down IDENT listener.");
-			m_identServer->Close();
-			m_identServer = NULL;
+			if(forgotten.Contains(it->second))
+				it = m_socketInodes.erase(it);
+			else
+				++it;
 		}
 	}
+
+	NoLongerNeedsIdentServer(vNetworks);
 }
 
 void CIdentServerMod::OnIRCConnected()
@@ -305,45 +2610,143 @@ void CIdentServerMod::OnIRCConnected()
 		PutModule("*** WARNING: Opening the listening socket failed!");
 		PutModule("*** IDENT listener is NOT running.");
 	}
-	NoLongerNeedsIdentServer();
+	if(m_sockIndex.Add(m_pNetwork))
+	{
+		m_dirtyNetworks.Erase(m_pNetwork);
+	}
+	ReleaseConnectSlot(m_pNetwork);
+	FinishConnectTiming(m_pNetwork, true);
+
+	if(m_uAnswerWindow == 0)
+	{
+		NoLongerNeedsIdentServer();
+		return;
+	}
+
+	// some servers only get around to the ident lookup after 001
+	const time_t tDeadline = time(NULL) + m_uAnswerWindow;
+	m_answerWindows[m_pNetwork] = tDeadline;
+	m_answerWindowQueue.push_back(std::make_pair(tDeadline, m_pNetwork));
+
+	if(!m_pAnswerWindowTimer)
+	{
+		m_pAnswerWindowTimer = new CIdentAnswerWindowTimer(this);
+		AddTimer(m_pAnswerWindowTimer);
+	}
 }
 
-void CIdentServerMod::OnIRCDisconnected()
+void CIdentServerMod::AddAcceptedSocket(CIdentAcceptedSocket *pSock)
 {
-	NoLongerNeedsIdentServer();
+	m_acceptedSockets.insert(pSock);
+
+	if(!m_pClientTimeoutTimer)
+	{
+		m_pClientTimeoutTimer = new CIdentClientTimeoutTimer(this);
+		AddTimer(m_pClientTimeoutTimer);
+	}
 }
 
-CIdentServerMod::EModRet CIdentServerMod::OnDeleteUser(CUser& User)
+void CIdentServerMod::ExpireAcceptedSockets()
 {
-	// NoLongerNeedsIdentServer needs m_pNetwork, so we have to provide it:
+	const uint64_t uNowMs = IdentNowMs();
+
+	// Close() leaves the socket in the set until Csock deletes it:
+	for(CIdentAcceptedSocket *pSock : m_acceptedSockets)
+	{
+		pSock->ExpireIfIdle(uNowMs);
+	}
+}
 
-	CIRCNetwork* pBackup = m_pNetwork;
+void CIdentServerMod::ExpireAnswerWindows()
+{
+	const time_t tNow = time(NULL);
+	std::vector<CIRCNetwork*> vExpired;
 
-	for(CIRCNetwork* pNetwork : User.GetNetworks())
+	// with a constant AnswerWindow the queue is sorted; after it was lowered
+	// a window may end up to the old length late, which is harmless
+	while(!m_answerWindowQueue.empty() && m_answerWindowQueue.front().first <= tNow)
 	{
-		m_pNetwork = pNetwork;
+		const std::pair<time_t, CIRCNetwork*> expired = m_answerWindowQueue.front();
+		m_answerWindowQueue.pop_front();
 
-		NoLongerNeedsIdentServer();
+		auto it = m_answerWindows.find(expired.second);
+		if(it == m_answerWindows.end() || it->second != expired.first)
+		{
+			// disconnected, deleted or reconnected in the meantime
+			continue;
+		}
+
+		m_answerWindows.erase(it);
+		vExpired.push_back(expired.second);
 	}
 
-	m_pNetwork = pBackup;
+	if(!vExpired.empty())
+	{
+		NoLongerNeedsIdentServer(vExpired);
+	}
+}
+
+void CIdentServerMod::OnIRCDisconnected()
+{
+	m_sockIndex.Remove(m_pNetwork);
+	m_dirtyNetworks.Erase(m_pNetwork);
+	m_answerWindows.erase(m_pNetwork);
+	ReleaseConnectSlot(m_pNetwork);
+	// before 001, the attempt failed
+	FinishConnectTiming(m_pNetwork, false);
+	NoLongerNeedsIdentServer();
+}
+
+CIdentServerMod::EModRet CIdentServerMod::OnDeleteUser(CUser& User)
+{
+	ForgetNetworks(User.GetNetworks());
 
 	return CONTINUE;
 }
 
 CIdentServerMod::EModRet CIdentServerMod::OnDeleteNetwork(CIRCNetwork& Network)
 {
-	CIRCNetwork* pBackup = m_pNetwork;
+	ForgetNetworks(std::vector<CIRCNetwork*>(1, &Network));
+
+	return CONTINUE;
+}
+
+CIdentServerMod::EModRet CIdentServerMod::OnUserRaw(CString& sLine)
+{
+	// "/msg *controlpanel Set Ident <user> <ident>" never shows up in a hook
+	// of ours otherwise. Cheap checks first, this sees every client line.
+	if(!sLine.Token(0).Equals("PRIVMSG"))
+	{
+		return CONTINUE;
+	}
 
-	m_pNetwork = &Network; // meh
+	if(!sLine.Token(1).Equals(m_pUser->GetStatusPrefix() + "controlpanel"))
+	{
+		return CONTINUE;
+	}
 
-	NoLongerNeedsIdentServer();
+	const CString sText = sLine.Token(2, true).TrimPrefix_n(":");
 
-	m_pNetwork = pBackup;
+	if(sText.Token(0).Equals("Set") && sText.Token(1).Equals("Ident"))
+	{
+		// controlpanel makes the change later in the same ReadLine, no query
+		// can come in between and cache the old ident again
+		m_sockIndex.InvalidateIdents();
+	}
 
 	return CONTINUE;
 }
 
+void CIdentServerMod::OnPostRehash()
+{
+	// znc.conf may have given users other idents:
+	m_sockIndex.InvalidateIdents();
+
+	// and added or removed users and networks, start a new pass over all of them:
+	m_sCheckUser.clear();
+	m_uCheckNetwork = 0;
+}
+
 void CIdentServerMod::OnClientLogin()
 {
 	if(m_listenFailed)
@@ -367,23 +2770,68 @@ void CIdentServerMod::OnModCommand(const CString& sLine)
 		Table.SetCell("Command", "Status");
 		Table.SetCell("Description", "Displays status information about IdentServer");
 
+		Table.AddRow();
+		Table.SetCell("Command", "Metrics");
+		Table.SetCell("Description", "Prints all counters in Prometheus text format, see MetricsPort to scrape them (admin only)");
+
+		Table.AddRow();
+		Table.SetCell("Command", "History [count]");
+		Table.SetCell("Description", "Lists the most recent IDENT requests and replies (admin only)");
+
+		Table.AddRow();
+		Table.SetCell("Command", "Timings [user[/network]] [count]");
+		Table.SetCell("Description", "How long connecting networks waited for the IDENT request, its reply and 001 (all users: admin only)");
+
+		Table.AddRow();
+		Table.SetCell("Command", "RateLimits [count]");
+		Table.SetCell("Description", "Lists the addresses RateLimit is tracking, most recent first (admin only)");
+
+		Table.AddRow();
+		Table.SetCell("Command", "Set [name value]");
+		Table.SetCell("Description", "Changes and saves a setting, or lists them all (admin only)");
+
 		PutModule(Table);
 		return;
 	}
 	else if(sCommand.Equals("STATUS"))
 	{
-		if(m_identServer)
+		if(IsListening())
 		{
-			PutModule("IdentServer is listening on: " + m_identServer->GetLocalIP() + ":" + CString(m_serverPort));
+			CString sAddrs;
+			if(m_bThreaded)
+			{
+				for(const CString& sHost : m_vsListenHosts)
+					sAddrs += (sAddrs.empty() ? "" : ", ") + sHost + ":" + CString(m_serverPort);
+				if(sAddrs.empty())
+					sAddrs = "*:" + CString(m_serverPort);
+			}
+			else
+			{
+				for(CIdentServer *pServer : m_vIdentServers)
+					sAddrs += (sAddrs.empty() ? "" : ", ") + pServer->GetLocalIP() + ":" + CString(m_serverPort);
+			}
+
+			PutModule("IdentServer is listening on: " + sAddrs +
+				(m_bThreaded ? " (threaded, " + CString((unsigned long long)m_pThreadServer->GetWorkerCount()) + " workers)" : "") +
+				(m_bPersistent ? " (persistent, " + CString(InUse() ? "answering" : "idle") + ")" : ""));
+
+			if(m_listenFailed)
+			{
+				PutModule("WARNING: Opening the listening socket failed for some of the addresses!");
+			}
 
 			if(m_pUser->IsAdmin())
 			{
+				PutModule("Indexed IRC connections: " + CString((unsigned long long)m_sockIndex.GetSize()) + ", from " + CString((unsigned long long)m_sockIndex.GetPartitionCount()) + " local addresses");
+				if(m_uAnswerWindow > 0)
+				{
+					PutModule("Connected networks still in their answer window: " + CString((unsigned long long)m_answerWindows.size()));
+				}
 				PutModule("List of active users/networks:");
 
-				for(CIRCNetwork* pNetwork : m_identServer->GetActiveUsers())
-				{
+				m_activeUsers.ForEach([&](CIRCNetwork *pNetwork) {
 					PutModule("* " + pNetwork->GetUser()->GetCleanUserName() + "/" + pNetwork->GetName());
-				}
+				});
 			}
 		}
 		else
@@ -396,8 +2844,231 @@ void CIdentServerMod::OnModCommand(const CString& sLine)
 		}
 		if(m_pUser->IsAdmin())
 		{
-			PutModule("Last IDENT request: " + m_sLastRequest);
-			PutModule("Last IDENT reply: " + m_sLastReply);
+			PutModule("Requests: " + CString((unsigned long long)m_metrics.queries.Get()) + ", answered from the index: " + CString((unsigned long long)m_metrics.indexHits.Get()) +
+				", scans of unindexed networks: " + CString((unsigned long long)m_metrics.scans.Get()) + " (" + CString((unsigned long long)m_metrics.scannedNetworks.Get()) + " networks checked)");
+			PutModule("Lookup latency: p50 < " + CString((unsigned long long)m_metrics.lookupLatency.GetQuantileLimitNs(0.5)) + "ns, p99 < " +
+				CString((unsigned long long)m_metrics.lookupLatency.GetQuantileLimitNs(0.99)) + "ns, see 'Metrics' for more");
+			PutModule("Consistency check: " + CString((unsigned long long)m_metrics.checkedNetworks.Get()) + " networks checked, " +
+				CString((unsigned long long)m_metrics.repairedNetworks.Get()) + " repaired, " +
+				CString((unsigned long long)m_dirtyNetworks.GetSize()) + " waiting to be indexed");
+			if(m_bKernelLookup)
+			{
+				PutModule(m_sockDiag.IsOpen() ?
+					"Kernel lookups: " + CString((unsigned long long)m_metrics.kernelLookups.Get()) + ", matched: " + CString((unsigned long long)m_metrics.kernelHits.Get()) +
+						", skipped over KernelLookupRate: " + CString((unsigned long long)m_sockDiag.GetSkipped()) :
+					CString("WARNING: Opening the NETLINK_SOCK_DIAG socket failed, KernelLookup is off!"));
+			}
+			if(m_uConnectWindow > 0 || !m_heldBack.empty())
+			{
+				PutModule("Connect window: " + CString(m_uConnectWindow) + " per server, " + CString((unsigned long long)m_connectSlots.size()) +
+					" connecting to " + CString((unsigned long long)m_connectingPerServer.size()) + " servers, " +
+					CString((unsigned long long)m_heldBack.size()) + " waiting in the connect queue (" + CString((unsigned long long)m_metrics.heldBack.Get()) + " attempts held back so far)");
+			}
+			PutModule("Open IDENT connections: " + CString((unsigned long long)(GetAcceptedSocketCount() + (m_pThreadServer ? m_pThreadServer->GetOpenConnections() : 0))) + "/" + (m_uMaxClients > 0 ? CString(m_uMaxClients) : CString("unlimited")) +
+				", refused: " + CString((unsigned long long)m_metrics.refused.Get()) + ", closed for overlong lines: " + CString((unsigned long long)m_metrics.overlong.Get()) +
+				", rate limited: " + CString((unsigned long long)m_metrics.rateLimited.Get()));
+			if(!m_sExportFile.empty())
+			{
+				PutModule(m_exportTable.IsOpen() ?
+					"Exporting to " + CString(m_exportTable.GetPath()) + ": " + CString((unsigned long long)m_exportTable.GetUsed()) + "/" + CString((unsigned long long)m_exportTable.GetSlotCount()) + " slots used" :
+					CString("WARNING: Creating the export file " + m_sExportFile + " failed!"));
+			}
+			if(m_pIdentService)
+			{
+				PutModule("Ident service " + m_sIdentService + (m_pIdentService->IsConnected() ? " is connected, " : " is NOT connected, ") +
+					CString((unsigned long long)m_pIdentService->GetOverrideCount()) + " overrides, " +
+					CString((unsigned long long)m_pIdentService->GetWaitingCount()) + " networks waiting for a reply");
+			}
+			if(m_uMetricsPort > 0)
+			{
+				PutModule("Metrics are served on " + (m_sMetricsHost.empty() ? CString("*") : m_sMetricsHost) + ":" + CString(m_uMetricsPort) +
+					(m_metricsListenFailed ? " (WARNING: opening the listening socket failed!)" : ""));
+			}
+
+			CIdentHistoryRecord rec;
+			if(m_history.Get(0, rec))
+			{
+				PutModule("Last IDENT request: " + FormatRequest(rec) + " from " + rec.remoteAddr.ToString() + " on " + rec.localAddr.ToString());
+				PutModule("Last IDENT reply: " + CString(rec.szReply, rec.uReplyLen));
+			}
+			else
+			{
+				PutModule("Last IDENT request: ");
+				PutModule("Last IDENT reply: ");
+			}
+		}
+	}
+	else if(sCommand.Equals("SET"))
+	{
+		if(!m_pUser->IsAdmin())
+		{
+			PutModule("Access denied");
+			return;
+		}
+
+		const CString sName = sLine.Token(1);
+
+		if(sName.empty())
+		{
+			CTable Table;
+			Table.AddColumn("Setting");
+			Table.AddColumn("Value");
+			Table.AddColumn("Description");
+
+			for(const CIdentSetting& setting : g_aSettings)
+			{
+				Table.AddRow();
+				Table.SetCell("Setting", setting.szName);
+				Table.SetCell("Value", GetSetting(setting));
+				Table.SetCell("Description", setting.szDescription);
+			}
+
+			PutModule(Table);
+			return;
+		}
+
+		const CIdentSetting *pSetting = FindSetting(sName);
+		const CString sValue = sLine.Token(2, true);
+		CString sError;
+
+		if(!pSetting)
+		{
+			PutModule("Unknown setting [" + sName + "] try 'Set'");
+		}
+		else if(!ApplySetting(*pSetting, sValue, sError))
+		{
+			PutModule(sError);
+		}
+		else
+		{
+			SetNV(pSetting->szName, sValue);
+			PutModule(CString(pSetting->szName) + " = " + GetSetting(*pSetting));
+		}
+	}
+	else if(sCommand.Equals("METRICS"))
+	{
+		if(!m_pUser->IsAdmin())
+		{
+			PutModule("Access denied");
+			return;
+		}
+
+		VCString vsLines;
+		GetMetricsText().Split("\n", vsLines, false);
+
+		for(const CString& sMetricLine : vsLines)
+		{
+			PutModule(sMetricLine);
+		}
+	}
+	else if(sCommand.Equals("RATELIMITS"))
+	{
+		if(!m_pUser->IsAdmin())
+		{
+			PutModule("Access denied");
+			return;
+		}
+
+		if(!m_rateLimiter.IsEnabled())
+		{
+			PutModule("Rate limiting is off, see 'Set RateLimit'.");
+			return;
+		}
+
+		size_t uCount = sLine.Token(1).ToUInt();
+		if(uCount == 0)
+			uCount = 20;
+
+		CTable Table;
+		Table.AddColumn("Address");
+		Table.AddColumn("Allowed");
+		Table.AddColumn("Dropped");
+		Table.AddColumn("Tokens");
+		Table.AddColumn("Last seen");
+
+		const uint64_t uNowMs = IdentNowMs();
+		m_rateLimiter.ForEach(uCount, [&](const CIdentRateLimiter::CBucket& bucket) {
+			Table.AddRow();
+			Table.SetCell("Address", bucket.addr.ToString());
+			Table.SetCell("Allowed", CString((unsigned long long)bucket.uAllowed));
+			Table.SetCell("Dropped", CString((unsigned long long)bucket.uDropped));
+			Table.SetCell("Tokens", CString((unsigned long long)(bucket.uMilliTokens / 1000)));
+			Table.SetCell("Last seen", CString((unsigned long long)(uNowMs - bucket.uLastMs) / 1000) + "s ago");
+		});
+
+		PutModule(CString(m_uRateLimit) + "/s per address, burst " + CString(m_uRateBurst) + ". Tracking " +
+			CString((unsigned long long)m_rateLimiter.GetSize()) + " of " + CString((unsigned long long)m_rateLimiter.GetCapacity()) +
+			" addresses, " + CString((unsigned long long)m_rateLimiter.GetEvictions()) + " forgotten so far.");
+		if(!Table.empty())
+			PutModule(Table);
+	}
+	else if(sCommand.Equals("TIMINGS"))
+	{
+		CString sFilter = sLine.Token(1);
+		size_t uCount = sLine.Token(2).ToUInt();
+
+		if(sFilter.ToUInt() > 0 && sLine.Token(2).empty())
+		{
+			// just a count
+			uCount = sFilter.ToUInt();
+			sFilter.clear();
+		}
+		if(uCount == 0)
+			uCount = 20;
+
+		if(!m_pUser->IsAdmin())
+		{
+			// your own networks only
+			const CString sUserName = m_pUser->GetUserName();
+			if(sFilter.empty() || sFilter == "*")
+				sFilter = sUserName;
+			else if(!sFilter.Token(0, false, "/").Equals(sUserName))
+				sFilter = sUserName + "/" + sFilter;
+		}
+
+		PutTimings(sFilter, uCount);
+	}
+	else if(sCommand.Equals("HISTORY"))
+	{
+		if(!m_pUser->IsAdmin())
+		{
+			PutModule("Access denied");
+			return;
+		}
+
+		size_t uCount = sLine.Token(1).ToUInt();
+		if(uCount == 0)
+			uCount = 20;
+
+		CTable Table;
+		Table.AddColumn("Time");
+		Table.AddColumn("From");
+		Table.AddColumn("On");
+		Table.AddColumn("Request");
+		Table.AddColumn("Reply");
+
+		CIdentHistoryRecord rec;
+		for(size_t uAge = 0; uAge < uCount && uAge < CIdentHistory::SIZE; uAge++)
+		{
+			if(!m_history.Get(uAge, rec))
+				continue;
+
+			Table.AddRow();
+			Table.SetCell("Time", CUtils::FormatTime(rec.tWhen, "%Y-%m-%d %H:%M:%S", m_pUser->GetTimezone()));
+			Table.SetCell("From", rec.remoteAddr.ToString());
+			Table.SetCell("On", rec.localAddr.ToString());
+			Table.SetCell("Request", FormatRequest(rec));
+			Table.SetCell("Reply", CString(rec.szReply, rec.uReplyLen));
+		}
+
+		if(Table.empty())
+		{
+			PutModule("No IDENT requests recorded yet.");
+		}
+		else
+		{
+			PutModule(Table);
+			PutModule(CString((unsigned long long)m_history.GetTotal()) + " requests since the module was loaded.");
 		}
 	}
 	else
@@ -406,13 +3077,142 @@ void CIdentServerMod::OnModCommand(const CString& sLine)
 	}
 }
 
+CString CIdentServerMod::FormatRequest(const CIdentHistoryRecord& rec)
+{
+	return CString(rec.szRequest, rec.uRequestLen).Replace_n("\r", "").Replace_n("\n", " ").Trim_n();
+}
+
+CString CIdentServerMod::FormatDuration(uint64_t uNs)
+{
+	if(uNs < 1000ULL * 1000)
+		return CString((unsigned long long)(uNs / 1000)) + "us";
+	if(uNs < 10ULL * 1000 * 1000 * 1000)
+		return CString((unsigned long long)(uNs / (1000 * 1000))) + "ms";
+	return CString((unsigned long long)(uNs / (1000ULL * 1000 * 1000))) + "s";
+}
+
+void CIdentServerMod::PutTimings(const CString& sFilter, size_t uCount)
+{
+	// "user" matches all of its networks, "user/network" just that one:
+	auto matches = [&sFilter](const CIdentConnectTiming& timing) {
+		if(sFilter.empty())
+			return true;
+		const CString sName = timing.szName;
+		return sFilter.find('/') != CString::npos ? sName.Equals(sFilter) : sName.Token(0, false, "/").Equals(sFilter);
+	};
+
+	if(sFilter.empty())
+	{
+		CTable Table;
+		Table.AddColumn("Phase");
+		Table.AddColumn("Count");
+		Table.AddColumn("p50");
+		Table.AddColumn("p90");
+		Table.AddColumn("p99");
+
+		const struct { const char *szPhase; const CIdentLatencyHistogram *pHistogram; uint64_t uScale; } aPhases[] = {
+			{ "Connect to IDENT request", &m_timingLog.GetTimeToQueryUs(), 1000 },
+			{ "IDENT reply", &m_timingLog.GetReplyLatencyNs(), 1 },
+			{ "Connect to 001", &m_timingLog.GetTimeToConnectedUs(), 1000 },
+		};
+
+		for(const auto& phase : aPhases)
+		{
+			Table.AddRow();
+			Table.SetCell("Phase", phase.szPhase);
+			Table.SetCell("Count", CString((unsigned long long)phase.pHistogram->GetCount()));
+			Table.SetCell("p50", "< " + FormatDuration(phase.pHistogram->GetQuantileLimitNs(0.5) * phase.uScale));
+			Table.SetCell("p90", "< " + FormatDuration(phase.pHistogram->GetQuantileLimitNs(0.9) * phase.uScale));
+			Table.SetCell("p99", "< " + FormatDuration(phase.pHistogram->GetQuantileLimitNs(0.99) * phase.uScale));
+		}
+
+		PutModule(Table);
+		PutModule(CString((unsigned long long)m_timingLog.GetTotal()) + " connection attempts since the module was loaded, " +
+			CString((unsigned long long)m_connectTimings.size()) + " connecting right now. 'Timings <user>[/<network>]' for single ones.");
+		return;
+	}
+
+	CTable Table;
+	Table.AddColumn("Started");
+	Table.AddColumn("Network");
+	Table.AddColumn("IDENT request");
+	Table.AddColumn("Reply");
+	Table.AddColumn("001");
+	Table.AddColumn("Requests");
+
+	auto addRow = [&](const CIdentConnectTiming& timing, bool bConnecting) {
+		Table.AddRow();
+		Table.SetCell("Started", CUtils::FormatTime(timing.tWhen, "%Y-%m-%d %H:%M:%S", m_pUser->GetTimezone()));
+		Table.SetCell("Network", timing.szName);
+		Table.SetCell("IDENT request", timing.uQueryNs ? "after " + FormatDuration(timing.uQueryNs - timing.uConnectingNs) : CString("none"));
+		Table.SetCell("Reply", timing.uQueryNs ? "took " + FormatDuration(timing.uAnsweredNs - timing.uQueryNs) : CString(""));
+		Table.SetCell("001", timing.uConnectedNs ? "after " + FormatDuration(timing.uConnectedNs - timing.uConnectingNs) :
+			CString(bConnecting ? "connecting" : "failed"));
+		Table.SetCell("Requests", CString((unsigned long long)timing.uQueries));
+	};
+
+	size_t uShown = 0;
+
+	for(const auto& it : m_connectTimings)
+	{
+		if(uShown < uCount && matches(it.second))
+		{
+			addRow(it.second, true);
+			uShown++;
+		}
+	}
+
+	for(size_t uAge = 0; uShown < uCount && uAge < CIdentTimingLog::SIZE; uAge++)
+	{
+		const CIdentConnectTiming *pTiming = m_timingLog.Get(uAge);
+
+		if(!pTiming)
+			break;
+
+		if(matches(*pTiming))
+		{
+			addRow(*pTiming, false);
+			uShown++;
+		}
+	}
+
+	if(Table.empty())
+		PutModule("No connection attempts of " + sFilter + " recorded.");
+	else
+		PutModule(Table);
+}
+
 CIdentServerMod::~CIdentServerMod()
 {
-	if(m_identServer)
+	for(CIdentServer *pServer : m_vIdentServers)
+	{
+		pServer->Close();
+	}
+
+	// before the snapshot, history and metrics it uses go away:
+	delete m_pThreadServer;
+	m_sockIndex.SetPublisher(NULL);
+	m_sockIndex.SetExport(NULL);
+	m_sockIndex.SetSource(NULL);
+	delete m_pIdentService;
+
+	if(m_pMetricsListener)
+	{
+		m_pMetricsListener->Close();
+	}
+
+	// CModule deletes our sockets after this object is gone:
+	for(CIdentAcceptedSocket *pSock : m_acceptedSockets)
 	{
-		m_identServer->Close();
+		pSock->Detach();
 	}
 }
 
 
+template<> void TModInfo<CIdentServerMod>(CModInfo& Info)
+{
+	Info.SetHasArgs(true);
+	Info.SetArgsHelpText("Optional settings as name=value, e.g. trace=2. See the Set command.");
+}
+
 GLOBALMODULEDEFS(CIdentServerMod, "Provides a simple IDENT server implementation.")
@@ -0,0 +1,3079 @@
+/*
+* Copyright (C) 2009-2013 Ingmar Runge <ingmar@irsoft.de>
+* See the AUTHORS file for details.
+*
+* Hot path helpers for the identserv module. Nothing in here depends on
+* ZNC, so the benchmarks under bench/ can build against it directly.
+*
+* This program is free software; you can redistribute it and/or modify it
+* under the terms of the GNU General Public License version 2 as published
+* by the Free Software Foundation.
+*/
+
+#ifndef IDENTSERV_CORE_H
+#define IDENTSERV_CORE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/************************************************************************/
+/*   ADDRESSES                                                          */
+/************************************************************************/
+
+/**
+* An IPv4 or IPv6 address, parsed once so comparing and hashing it is cheap.
+* IPv4 addresses are kept in their v4-mapped IPv6 form, so "1.2.3.4" and
+* "::ffff:1.2.3.4" are the same address.
+**/
+struct CIdentAddr
+{
+	in6_addr addr;
+
+	CIdentAddr() { memset(&addr, 0, sizeof(addr)); }
+
+	bool Parse(const char *pIP, size_t uLen)
+	{
+		char szIP[INET6_ADDRSTRLEN];
+
+		// drop a scope id ("fe80::1%eth0"), inet_pton doesn't take those:
+		const void *pScope = memchr(pIP, '%', uLen);
+		if(pScope)
+			uLen = (size_t)(static_cast<const char*>(pScope) - pIP);
+
+		memset(&addr, 0, sizeof(addr));
+
+		if(uLen >= sizeof(szIP))
+			return false;
+
+		memcpy(szIP, pIP, uLen);
+		szIP[uLen] = 0;
+
+		if(inet_pton(AF_INET6, szIP, &addr) == 1)
+			return true;
+
+		in_addr addr4;
+		if(inet_pton(AF_INET, szIP, &addr4) == 1)
+		{
+			addr.s6_addr[10] = 0xff;
+			addr.s6_addr[11] = 0xff;
+			memcpy(&addr.s6_addr[12], &addr4, 4);
+			return true;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		return false;
+	}
+
+	bool Parse(const std::string& sIP) { return Parse(sIP.data(), sIP.size()); }
+
+	/** from what accept() or getsockname() filled in, false for anything but AF_INET/AF_INET6 **/
+	bool Set(const sockaddr *pAddr)
+	{
+		memset(&addr, 0, sizeof(addr));
+
+		if(pAddr->sa_family == AF_INET6)
+		{
+			addr = reinterpret_cast<const sockaddr_in6*>(pAddr)->sin6_addr;
+			return true;
+		}
+
+		if(pAddr->sa_family == AF_INET)
+		{
+			addr.s6_addr[10] = 0xff;
+			addr.s6_addr[11] = 0xff;
+			memcpy(&addr.s6_addr[12], &reinterpret_cast<const sockaddr_in*>(pAddr)->sin_addr, 4);
+			return true;
+		}
+
+		return false;
+	}
+
+	/** writes the presentation form, IPv4 without the ::ffff: prefix **/
+	void Format(char *szBuf, size_t uSize) const
+	{
+		if(IN6_IS_ADDR_V4MAPPED(&addr))
+			inet_ntop(AF_INET, &addr.s6_addr[12], szBuf, (socklen_t)uSize);
+		else
+			inet_ntop(AF_INET6, &addr, szBuf, (socklen_t)uSize);
+	}
+
+	std::string ToString() const
+	{
+		char szIP[INET6_ADDRSTRLEN];
+		Format(szIP, sizeof(szIP));
+		return szIP;
+	}
+
+	bool operator==(const CIdentAddr& other) const { return memcmp(&addr, &other.addr, sizeof(addr)) == 0; }
+	bool operator!=(const CIdentAddr& other) const { return !(*this == other); }
+
+	size_t Hash() const
+	{
+		uint64_t uHigh, uLow;
+		memcpy(&uHigh, &addr, 8);
+		memcpy(&uLow, reinterpret_cast<const char*>(&addr) + 8, 8);
+		return (size_t)((uHigh * 0x9E3779B97F4A7C15ULL) ^ uLow);
+	}
+};
+
+/************************************************************************/
+/*   REQUEST PARSER                                                     */
+/************************************************************************/
+
+enum EIdentParseResult
+{
+	IDENT_PARSE_OK,
+	IDENT_PARSE_INVALID_PORT, // well-formed, but a port is not in 1..65535
+	IDENT_PARSE_MALFORMED
+};
+
+static inline bool IdentIsSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/**
+* Reads the digits at p into uPort. Values above 65535 are returned as
+* 65536 instead of wrapping around. Returns NULL if there are no digits.
+**/
+static inline const char *IdentParsePort(const char *p, const char *pEnd, unsigned int& uPort)
+{
+	const char *pStart = p;
+	unsigned int uValue = 0;
+
+	for(; p < pEnd && *p >= '0' && *p <= '9'; ++p)
+	{
+		if(uValue <= 65535)
+			uValue = uValue * 10 + (unsigned int)(*p - '0');
+	}
+
+	if(p == pStart)
+		return NULL;
+
+	uPort = (uValue > 65535 ? 65536 : uValue);
+	return p;
+}
+
+/**
+* Parses an RFC 1413 query ("<port> , <port>", optionally followed by the
+* line terminator) straight from the read buffer, without allocating.
+* Ports that were read and are in range are stored even if the other
+* one is not, so the reply can echo them. Everything else is left at 0.
+**/
+static inline EIdentParseResult IdentParseRequest(const char *pLine, size_t uLen, unsigned short& uLocalPort, unsigned short& uRemotePort)
+{
+	const char *p = pLine, *pEnd = pLine + uLen;
+	unsigned int uLocal, uRemote;
+
+	uLocalPort = uRemotePort = 0;
+
+	while(p < pEnd && IdentIsSpace(*p))
+		++p;
+
+	if(!(p = IdentParsePort(p, pEnd, uLocal)))
+		return IDENT_PARSE_MALFORMED;
+
+	while(p < pEnd && IdentIsSpace(*p))
+		++p;
+
+	if(p == pEnd || *p != ',')
+		return IDENT_PARSE_MALFORMED;
+	++p;
+
+	while(p < pEnd && IdentIsSpace(*p))
+		++p;
+
+	if(!(p = IdentParsePort(p, pEnd, uRemote)))
+		return IDENT_PARSE_MALFORMED;
+
+	while(p < pEnd && (IdentIsSpace(*p) || *p == '\r' || *p == '\n'))
+		++p;
+
+	if(p != pEnd)
+		return IDENT_PARSE_MALFORMED;
+
+	const bool bLocalValid = (uLocal >= 1 && uLocal <= 65535);
+	const bool bRemoteValid = (uRemote >= 1 && uRemote <= 65535);
+
+	if(bLocalValid)
+		uLocalPort = (unsigned short)uLocal;
+	if(bRemoteValid)
+		uRemotePort = (unsigned short)uRemote;
+
+	return (bLocalValid && bRemoteValid) ? IDENT_PARSE_OK : IDENT_PARSE_INVALID_PORT;
+}
+
+/************************************************************************/
+/*   REPLY WRITER                                                       */
+/************************************************************************/
+
+/** how much of an ident goes into a reply: up to MAX_USERID and the first CR, LF or NUL **/
+static inline size_t IdentSafeLength(const char *pIdent, size_t uIdentLen, size_t uMax)
+{
+	// never let an ident end the line early or smuggle in another one:
+	size_t uSafeLen = 0;
+	while(uSafeLen < uIdentLen && uSafeLen < uMax &&
+		pIdent[uSafeLen] != '\r' && pIdent[uSafeLen] != '\n' && pIdent[uSafeLen] != '\0')
+		++uSafeLen;
+	return uSafeLen;
+}
+
+/**
+* The "UNIX : <ident>" part of a USERID reply, formatted once per connection
+* instead of once per query. Sized so a whole TIdentSockIndex entry fits one
+* cache line, longer idents aren't cached.
+**/
+struct CIdentUserIdCache
+{
+	enum { MAX_TEXT = 40 };
+
+	uint32_t uGeneration; // of the ident it was made from, 0 if there's nothing
+	uint32_t uLen;
+	char szText[MAX_TEXT]; // not terminated
+
+	CIdentUserIdCache() : uGeneration(0), uLen(0) {}
+
+	/** whether the text was made from this ident **/
+	bool Matches(const char *pIdent, size_t uIdentLen) const
+	{
+		const size_t uSafeLen = IdentSafeLength(pIdent, uIdentLen, MAX_TEXT);
+		return uGeneration != 0 && uLen == 7 + uSafeLen && memcmp(szText + 7, pIdent, uSafeLen) == 0;
+	}
+
+	/** false (and nothing cached) if the ident doesn't fit **/
+	bool Set(const char *pIdent, size_t uIdentLen, uint32_t uIdentGeneration)
+	{
+		const size_t uSafeLen = IdentSafeLength(pIdent, uIdentLen, MAX_TEXT);
+
+		if(uSafeLen > MAX_TEXT - 7)
+		{
+			uGeneration = 0;
+			return false;
+		}
+
+		memcpy(szText, "UNIX : ", 7);
+		memcpy(szText + 7, pIdent, uSafeLen);
+		uLen = (uint32_t)(7 + uSafeLen);
+		uGeneration = uIdentGeneration;
+		return true;
+	}
+};
+
+/**
+* Formats a complete RFC 1413 reply line, including the trailing CRLF,
+* into a fixed buffer so it can be handed to Write() in one go.
+* RFC 1413 caps the user id at 512 octets, longer ones are cut off.
+**/
+class CIdentReplyWriter
+{
+public:
+	enum
+	{
+		MAX_USERID = 512,
+		MAX_REPLY = MAX_USERID + 64
+	};
+
+protected:
+	char m_szBuf[MAX_REPLY];
+	size_t m_uLen;
+
+	void Append(const char *p, size_t uLen)
+	{
+		if(uLen > sizeof(m_szBuf) - m_uLen)
+			uLen = sizeof(m_szBuf) - m_uLen;
+		memcpy(m_szBuf + m_uLen, p, uLen);
+		m_uLen += uLen;
+	}
+
+	void Append(const char *sz) { Append(sz, strlen(sz)); }
+
+	void AppendPort(unsigned short uPort)
+	{
+		char szDigits[5];
+		size_t uDigits = 0;
+
+		do
+		{
+			szDigits[sizeof(szDigits) - ++uDigits] = (char)('0' + uPort % 10);
+			uPort /= 10;
+		} while(uPort);
+
+		Append(szDigits + sizeof(szDigits) - uDigits, uDigits);
+	}
+
+	void Begin(unsigned short uLocalPort, unsigned short uRemotePort, const char *szType)
+	{
+		m_uLen = 0;
+		AppendPort(uLocalPort);
+		Append(", ", 2);
+		AppendPort(uRemotePort);
+		Append(" : ", 3);
+		Append(szType);
+		Append(" : ", 3);
+	}
+
+	void End()
+	{
+		// always leave room for the line terminator:
+		if(m_uLen > sizeof(m_szBuf) - 2)
+			m_uLen = sizeof(m_szBuf) - 2;
+		m_szBuf[m_uLen++] = '\r';
+		m_szBuf[m_uLen++] = '\n';
+	}
+
+public:
+	CIdentReplyWriter() : m_uLen(0) {}
+
+	/** "<port>, <port> : USERID : UNIX : <ident>" **/
+	void FormatUserId(unsigned short uLocalPort, unsigned short uRemotePort, const char *pIdent, size_t uIdentLen)
+	{
+		Begin(uLocalPort, uRemotePort, "USERID");
+		Append("UNIX : ", 7);
+		Append(pIdent, IdentSafeLength(pIdent, uIdentLen, MAX_USERID));
+		End();
+	}
+
+	/** the same from "UNIX : <ident>" text that has been through IdentSafeLength already **/
+	void FormatUserIdText(unsigned short uLocalPort, unsigned short uRemotePort, const char *pText, size_t uTextLen)
+	{
+		Begin(uLocalPort, uRemotePort, "USERID");
+		Append(pText, uTextLen);
+		End();
+	}
+
+	void FormatUserId(unsigned short uLocalPort, unsigned short uRemotePort, const CIdentUserIdCache& userId)
+	{
+		FormatUserIdText(uLocalPort, uRemotePort, userId.szText, userId.uLen);
+	}
+
+	/** "<port>, <port> : ERROR : <error>", e.g. NO-USER or INVALID-PORT **/
+	void FormatError(unsigned short uLocalPort, unsigned short uRemotePort, const char *szError)
+	{
+		Begin(uLocalPort, uRemotePort, "ERROR");
+		Append(szError);
+		End();
+	}
+
+	const char *GetData() const { return m_szBuf; }
+	size_t GetSize() const { return m_uLen; }
+	/** length without the trailing CRLF **/
+	size_t GetLineSize() const { return m_uLen >= 2 ? m_uLen - 2 : 0; }
+};
+
+/************************************************************************/
+/*   QUERY HISTORY                                                      */
+/************************************************************************/
+
+/**
+* One exchange as it went over the wire, truncated to fit. Only formatted
+* for display when somebody asks for it.
+**/
+struct CIdentHistoryRecord
+{
+	enum
+	{
+		MAX_REQUEST = 64,
+		MAX_REPLY = 128
+	};
+
+	time_t tWhen;
+	CIdentAddr localAddr;
+	CIdentAddr remoteAddr;
+	unsigned char uRequestLen;
+	unsigned char uReplyLen;
+	char szRequest[MAX_REQUEST];
+	char szReply[MAX_REPLY];
+};
+
+/**
+* Ring buffer of the last SIZE exchanges. Writers claim a slot with one
+* atomic increment and never wait; every slot carries a sequence number
+* (seqlock style) so a reader can tell a finished record from one that is
+* being overwritten underneath it, and simply skips the latter.
+**/
+class CIdentHistory
+{
+public:
+	enum { SIZE = 256 };
+
+protected:
+	struct CSlot
+	{
+		std::atomic<uint64_t> uSeq; // 2 * position + 1 while writing, + 2 when done
+		CIdentHistoryRecord record;
+	};
+
+	std::atomic<uint64_t> m_uNext;
+	CSlot m_aSlots[SIZE];
+
+public:
+	CIdentHistory() : m_uNext(0)
+	{
+		for(CSlot& slot : m_aSlots)
+			slot.uSeq.store(0, std::memory_order_relaxed);
+	}
+
+	void Add(const char *pRequest, size_t uRequestLen, const CIdentAddr& localAddr, const CIdentAddr& remoteAddr,
+		const char *pReply, size_t uReplyLen)
+	{
+		const uint64_t uPos = m_uNext.fetch_add(1, std::memory_order_relaxed);
+		CSlot& slot = m_aSlots[uPos % SIZE];
+
+		slot.uSeq.store(2 * uPos + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		CIdentHistoryRecord& rec = slot.record;
+		rec.tWhen = time(NULL);
+		rec.localAddr = localAddr;
+		rec.remoteAddr = remoteAddr;
+		rec.uRequestLen = (unsigned char)(uRequestLen < sizeof(rec.szRequest) ? uRequestLen : sizeof(rec.szRequest));
+		memcpy(rec.szRequest, pRequest, rec.uRequestLen);
+		rec.uReplyLen = (unsigned char)(uReplyLen < sizeof(rec.szReply) ? uReplyLen : sizeof(rec.szReply));
+		memcpy(rec.szReply, pReply, rec.uReplyLen);
+
+		slot.uSeq.store(2 * uPos + 2, std::memory_order_release);
+	}
+
+	/** number of exchanges recorded so far, including those overwritten since **/
+	uint64_t GetTotal() const { return m_uNext.load(std::memory_order_relaxed); }
+
+	/**
+	* Copies the uAge-th most recent record (0 = newest). Returns false if
+	* there is no such record or it is being overwritten right now.
+	**/
+	bool Get(size_t uAge, CIdentHistoryRecord& rec) const
+	{
+		const uint64_t uNext = m_uNext.load(std::memory_order_acquire);
+
+		if(uAge >= SIZE || uAge >= uNext)
+			return false;
+
+		const uint64_t uPos = uNext - 1 - uAge;
+		const CSlot& slot = m_aSlots[uPos % SIZE];
+
+		if(slot.uSeq.load(std::memory_order_acquire) != 2 * uPos + 2)
+			return false;
+
+		memcpy(&rec, &slot.record, sizeof(rec));
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		return slot.uSeq.load(std::memory_order_relaxed) == 2 * uPos + 2;
+	}
+};
+
+/************************************************************************/
+/*   RATE LIMITING                                                      */
+/************************************************************************/
+
+/** monotonic milliseconds, for intervals only **/
+static inline uint64_t IdentNowMs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+* Token bucket per remote address. The buckets live in a fixed array of
+* GetCapacity() entries, found through an open-addressing (linear probing)
+* table of twice that size. When the array is full the least recently
+* seen address is evicted, so memory stays fixed however many hosts try.
+**/
+class CIdentRateLimiter
+{
+public:
+	struct CBucket
+	{
+		CIdentAddr addr;
+		uint64_t uLastMs;
+		uint64_t uMilliTokens; // 1000 per connection, 64 bits so any RateBurst fits
+		uint32_t uPrev, uNext; // LRU list, most recent first
+		uint64_t uAllowed;
+		uint64_t uDropped;
+	};
+
+protected:
+	enum : uint32_t { NONE = 0xFFFFFFFF };
+
+	std::vector<CBucket> m_vBuckets;
+	std::vector<uint32_t> m_vTable; // bucket index or NONE
+	uint32_t m_uUsed;
+	uint32_t m_uHead, m_uTail;
+	unsigned int m_uRate; // connections per second, 0 = off
+	unsigned int m_uBurst;
+	uint64_t m_uEvictions;
+
+	size_t Slot(const CIdentAddr& addr) const { return addr.Hash() & (m_vTable.size() - 1); }
+
+	size_t FindSlot(const CIdentAddr& addr) const
+	{
+		size_t uSlot = Slot(addr);
+
+		while(m_vTable[uSlot] != NONE && m_vBuckets[m_vTable[uSlot]].addr != addr)
+			uSlot = (uSlot + 1) & (m_vTable.size() - 1);
+
+		return uSlot;
+	}
+
+	void Unlink(uint32_t uIdx)
+	{
+		CBucket& bucket = m_vBuckets[uIdx];
+
+		if(bucket.uPrev != NONE)
+			m_vBuckets[bucket.uPrev].uNext = bucket.uNext;
+		else
+			m_uHead = bucket.uNext;
+
+		if(bucket.uNext != NONE)
+			m_vBuckets[bucket.uNext].uPrev = bucket.uPrev;
+		else
+			m_uTail = bucket.uPrev;
+	}
+
+	void PushFront(uint32_t uIdx)
+	{
+		CBucket& bucket = m_vBuckets[uIdx];
+
+		bucket.uPrev = NONE;
+		bucket.uNext = m_uHead;
+
+		if(m_uHead != NONE)
+			m_vBuckets[m_uHead].uPrev = uIdx;
+		m_uHead = uIdx;
+
+		if(m_uTail == NONE)
+			m_uTail = uIdx;
+	}
+
+	/** removes a slot from the probe table without leaving a hole in any probe sequence **/
+	void EraseSlot(size_t uSlot)
+	{
+		const size_t uMask = m_vTable.size() - 1;
+		size_t uNext = uSlot;
+
+		m_vTable[uSlot] = NONE;
+
+		while(true)
+		{
+			uNext = (uNext + 1) & uMask;
+
+			if(m_vTable[uNext] == NONE)
+				break;
+
+			// move the entry back if the hole is between its home slot and where it sits:
+			const size_t uHome = Slot(m_vBuckets[m_vTable[uNext]].addr);
+			if(((uNext - uHome) & uMask) >= ((uNext - uSlot) & uMask))
+			{
+				m_vTable[uSlot] = m_vTable[uNext];
+				m_vTable[uNext] = NONE;
+				uSlot = uNext;
+			}
+		}
+	}
+
+public:
+	CIdentRateLimiter() : m_uRate(0), m_uBurst(1), m_uEvictions(0) { SetCapacity(1024); }
+
+	/** drops all buckets; uCapacity is rounded up to a power of two **/
+	void SetCapacity(size_t uCapacity)
+	{
+		size_t uSize = 16;
+		while(uSize < uCapacity)
+			uSize *= 2;
+
+		m_vBuckets.assign(uSize, CBucket());
+		m_vTable.assign(uSize * 2, NONE);
+		m_uUsed = 0;
+		m_uHead = m_uTail = NONE;
+	}
+
+	void SetRate(unsigned int uPerSecond, unsigned int uBurst)
+	{
+		m_uRate = uPerSecond;
+		m_uBurst = (uBurst > 0 ? uBurst : 1);
+	}
+
+	bool IsEnabled() const { return m_uRate > 0; }
+	size_t GetCapacity() const { return m_vBuckets.size(); }
+	size_t GetSize() const { return m_uUsed; }
+	uint64_t GetEvictions() const { return m_uEvictions; }
+
+	/** takes a token from addr's bucket, false if it is empty **/
+	bool Allow(const CIdentAddr& addr, uint64_t uNowMs)
+	{
+		if(!IsEnabled())
+			return true;
+
+		const uint64_t uMaxTokens = 1000ULL * m_uBurst;
+		size_t uSlot = FindSlot(addr);
+		uint32_t uIdx = m_vTable[uSlot];
+
+		if(uIdx == NONE)
+		{
+			if(m_uUsed < m_vBuckets.size())
+			{
+				uIdx = m_uUsed++;
+			}
+			else
+			{
+				uIdx = m_uTail;
+				Unlink(uIdx);
+				EraseSlot(FindSlot(m_vBuckets[uIdx].addr));
+				m_uEvictions++;
+				// the erase may have moved entries into our probe sequence:
+				uSlot = FindSlot(addr);
+			}
+
+			CBucket& bucket = m_vBuckets[uIdx];
+			bucket.addr = addr;
+			bucket.uLastMs = uNowMs;
+			bucket.uMilliTokens = uMaxTokens;
+			bucket.uAllowed = bucket.uDropped = 0;
+
+			m_vTable[uSlot] = uIdx;
+			PushFront(uIdx);
+		}
+		else if(uIdx != m_uHead)
+		{
+			Unlink(uIdx);
+			PushFront(uIdx);
+		}
+
+		CBucket& bucket = m_vBuckets[uIdx];
+
+		if(uNowMs > bucket.uLastMs)
+		{
+			// a long enough gap fills the bucket, without multiplying it out:
+			const uint64_t uMs = uNowMs - bucket.uLastMs;
+			const uint64_t uRefill = (uMs >= uMaxTokens / m_uRate + 1) ? uMaxTokens : uMs * m_uRate;
+			bucket.uMilliTokens = (bucket.uMilliTokens + uRefill > uMaxTokens ? uMaxTokens : bucket.uMilliTokens + uRefill);
+			bucket.uLastMs = uNowMs;
+		}
+
+		if(bucket.uMilliTokens < 1000)
+		{
+			bucket.uDropped++;
+			return false;
+		}
+
+		bucket.uMilliTokens -= 1000;
+		bucket.uAllowed++;
+		return true;
+	}
+
+	/** calls f(const CBucket&) for up to uMax buckets, most recently seen first **/
+	template<typename F>
+	void ForEach(size_t uMax, F f) const
+	{
+		for(uint32_t uIdx = m_uHead; uIdx != NONE && uMax > 0; uIdx = m_vBuckets[uIdx].uNext, uMax--)
+			f(m_vBuckets[uIdx]);
+	}
+};
+
+/************************************************************************/
+/*   POINTER SET                                                        */
+/************************************************************************/
+
+/**
+* A set of pointers in one flat array, open addressing with linear probing.
+* Once it has grown to the most members it ever had, inserting and erasing
+* allocate nothing, which is what networks flapping in a reconnect storm
+* want. Iteration order is meaningless.
+**/
+template<typename T>
+class TIdentPtrSet
+{
+protected:
+	std::vector<T*> m_vSlots; // NULL: free, size is a power of two
+	size_t m_uSize;
+
+	size_t Slot(const T *p) const
+	{
+		// pointers share their low and high bits, mix them (murmur3 finalizer):
+		uint64_t u = (uint64_t)(uintptr_t)p;
+		u ^= u >> 33;
+		u *= 0xff51afd7ed558ccdULL;
+		u ^= u >> 33;
+		return (size_t)u & (m_vSlots.size() - 1);
+	}
+
+	/** the slot holding p, or the free one where it would go **/
+	size_t FindSlot(const T *p) const
+	{
+		const size_t uMask = m_vSlots.size() - 1;
+		size_t uSlot = Slot(p);
+
+		while(m_vSlots[uSlot] && m_vSlots[uSlot] != p)
+			uSlot = (uSlot + 1) & uMask;
+
+		return uSlot;
+	}
+
+	void Grow()
+	{
+		std::vector<T*> vOld(m_vSlots.empty() ? 16 : m_vSlots.size() * 2, (T*)NULL);
+		vOld.swap(m_vSlots);
+
+		for(T *p : vOld)
+		{
+			if(p)
+				m_vSlots[FindSlot(p)] = p;
+		}
+	}
+
+public:
+	TIdentPtrSet() : m_uSize(0) {}
+
+	/** false if p was in the set already **/
+	bool Insert(T *p)
+	{
+		// at most half full, probe sequences stay short:
+		if((m_uSize + 1) * 2 > m_vSlots.size())
+			Grow();
+
+		const size_t uSlot = FindSlot(p);
+
+		if(m_vSlots[uSlot])
+			return false;
+
+		m_vSlots[uSlot] = p;
+		m_uSize++;
+		return true;
+	}
+
+	/** false if p wasn't in the set **/
+	bool Erase(const T *p)
+	{
+		if(m_uSize == 0)
+			return false;
+
+		const size_t uMask = m_vSlots.size() - 1;
+		size_t uSlot = FindSlot(p);
+		size_t uNext = uSlot;
+
+		if(!m_vSlots[uSlot])
+			return false;
+
+		m_vSlots[uSlot] = NULL;
+		m_uSize--;
+
+		// backward shift, as in CIdentRateLimiter::EraseSlot:
+		while(true)
+		{
+			uNext = (uNext + 1) & uMask;
+
+			if(!m_vSlots[uNext])
+				break;
+
+			const size_t uHome = Slot(m_vSlots[uNext]);
+			if(((uNext - uHome) & uMask) >= ((uNext - uSlot) & uMask))
+			{
+				m_vSlots[uSlot] = m_vSlots[uNext];
+				m_vSlots[uNext] = NULL;
+				uSlot = uNext;
+			}
+		}
+
+		return true;
+	}
+
+	bool Contains(const T *p) const { return m_uSize > 0 && m_vSlots[FindSlot(p)] != NULL; }
+	bool IsEmpty() const { return m_uSize == 0; }
+	size_t GetSize() const { return m_uSize; }
+
+	/** calls f(T*) for every member, the set must not change meanwhile **/
+	template<typename F>
+	void ForEach(F f) const
+	{
+		for(T *p : m_vSlots)
+		{
+			if(p)
+				f(p);
+		}
+	}
+};
+
+/************************************************************************/
+/*   METRICS                                                            */
+/************************************************************************/
+
+static inline uint64_t IdentNowNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+* A counter any thread may bump. Relaxed, whoever reads it (STATUS,
+* METRICS) only needs a recent value, not one ordered against anything.
+**/
+class CIdentCounter
+{
+protected:
+	std::atomic<uint64_t> m_uValue;
+
+public:
+	CIdentCounter() : m_uValue(0) {}
+
+	void Inc(uint64_t uBy = 1) { m_uValue.fetch_add(uBy, std::memory_order_relaxed); }
+	uint64_t Get() const { return m_uValue.load(std::memory_order_relaxed); }
+};
+
+/**
+* Latency histogram with power of two buckets: bucket i counts the samples
+* below 2^i ns that don't fit into bucket i - 1. The last bucket takes
+* everything from 2^30 ns (about a second) up.
+**/
+class CIdentLatencyHistogram
+{
+public:
+	enum { BUCKETS = 32 };
+
+protected:
+	CIdentCounter m_aBuckets[BUCKETS];
+	CIdentCounter m_sumNs;
+
+public:
+	void Add(uint64_t uNs)
+	{
+		unsigned int uBucket = uNs ? 64 - __builtin_clzll(uNs) : 0;
+
+		if(uBucket >= BUCKETS)
+			uBucket = BUCKETS - 1;
+
+		m_aBuckets[uBucket].Inc();
+		m_sumNs.Inc(uNs);
+	}
+
+	uint64_t GetBucket(unsigned int uBucket) const { return m_aBuckets[uBucket].Get(); }
+	uint64_t GetSumNs() const { return m_sumNs.Get(); }
+
+	/** exclusive upper bound of a bucket, the last one has none **/
+	static uint64_t GetBucketLimitNs(unsigned int uBucket) { return (uint64_t)1 << uBucket; }
+
+	uint64_t GetCount() const
+	{
+		uint64_t uCount = 0;
+		for(const CIdentCounter& bucket : m_aBuckets)
+			uCount += bucket.Get();
+		return uCount;
+	}
+
+	/** upper bound of the bucket the given quantile (0..1) falls into, 0 without samples **/
+	uint64_t GetQuantileLimitNs(double dQuantile) const
+	{
+		const uint64_t uCount = GetCount();
+		uint64_t uSeen = 0;
+
+		if(uCount == 0)
+			return 0;
+
+		for(unsigned int uBucket = 0; uBucket < BUCKETS - 1; uBucket++)
+		{
+			uSeen += GetBucket(uBucket);
+			if(uSeen >= dQuantile * uCount)
+				return GetBucketLimitNs(uBucket);
+		}
+
+		return GetBucketLimitNs(BUCKETS - 1);
+	}
+};
+
+/**
+* Everything the module counts. The per-query counters are kept apart from
+* the ones only bumped when something gets refused, so in a flood the two
+* groups don't fight over the same cache lines.
+**/
+struct CIdentMetrics
+{
+	// hot, every query:
+	CIdentCounter queries;
+	CIdentCounter replyUserId;
+	CIdentCounter replyNoUser;
+	CIdentCounter replyInvalidPort;
+	CIdentCounter exactMatches;
+	CIdentCounter fallbackMatches;
+	CIdentCounter indexHits;
+	CIdentCounter scans;
+	CIdentCounter scannedNetworks;
+	CIdentCounter kernelLookups; // KernelLookup, NETLINK_SOCK_DIAG requests
+	CIdentCounter kernelHits;
+	CIdentCounter accepted;
+	CIdentLatencyHistogram lookupLatency;
+
+	char acColdPad[64];
+
+	// cold, rejections and connect throttling:
+	CIdentCounter refused; // over MaxClients
+	CIdentCounter overlong; // closed for exceeding MaxLineLength
+	CIdentCounter rateLimited;
+	CIdentCounter heldBack; // connection attempts sent back to ZNC's connect queue
+	CIdentCounter checkedNetworks; // by the consistency check
+	CIdentCounter repairedNetworks; // it found out of date
+};
+
+/************************************************************************/
+/*   CONNECT TIMINGS                                                    */
+/************************************************************************/
+
+/**
+* How one connection attempt of a network went. Monotonic nanoseconds,
+* 0 for what didn't happen (no IDENT request, no 001).
+**/
+struct CIdentConnectTiming
+{
+	enum { MAX_NAME = 64 };
+
+	time_t tWhen; // when it started, for display
+	uint64_t uConnectingNs;
+	uint64_t uQueryNs; // the first IDENT request for the socket came in
+	uint64_t uAnsweredNs; // and its reply was ready
+	uint64_t uConnectedNs; // 001
+	unsigned int uQueries;
+	char szName[MAX_NAME]; // "user/network", cut to fit
+
+	void Start(const char *pName, size_t uNameLen, uint64_t uNowNs)
+	{
+		memset(this, 0, sizeof(*this));
+		tWhen = time(NULL);
+		uConnectingNs = uNowNs;
+		if(uNameLen >= sizeof(szName))
+			uNameLen = sizeof(szName) - 1;
+		memcpy(szName, pName, uNameLen);
+	}
+
+	void AddQuery(uint64_t uStartNs, uint64_t uEndNs)
+	{
+		if(uQueries++ == 0)
+		{
+			uQueryNs = uStartNs;
+			uAnsweredNs = uEndNs;
+		}
+	}
+};
+
+/**
+* The last SIZE finished connection attempts, plus histograms over all of
+* them since the module was loaded. Fixed size however many networks
+* connect; main thread only.
+**/
+class CIdentTimingLog
+{
+public:
+	enum { SIZE = 1024 };
+
+protected:
+	CIdentConnectTiming m_aRecords[SIZE];
+	uint64_t m_uTotal;
+	// in microseconds, nanosecond buckets would top out at a second:
+	CIdentLatencyHistogram m_timeToQuery;
+	CIdentLatencyHistogram m_timeToConnected;
+	// nanoseconds:
+	CIdentLatencyHistogram m_replyLatency;
+
+public:
+	CIdentTimingLog() : m_uTotal(0) {}
+
+	void Add(const CIdentConnectTiming& timing)
+	{
+		if(timing.uQueryNs != 0)
+		{
+			m_timeToQuery.Add((timing.uQueryNs - timing.uConnectingNs) / 1000);
+			m_replyLatency.Add(timing.uAnsweredNs - timing.uQueryNs);
+		}
+		if(timing.uConnectedNs != 0)
+		{
+			m_timeToConnected.Add((timing.uConnectedNs - timing.uConnectingNs) / 1000);
+		}
+
+		m_aRecords[m_uTotal++ % SIZE] = timing;
+	}
+
+	/** attempts recorded so far, including those overwritten since **/
+	uint64_t GetTotal() const { return m_uTotal; }
+
+	/** the uAge-th most recent attempt (0 = newest), NULL if there's none **/
+	const CIdentConnectTiming *Get(size_t uAge) const
+	{
+		if(uAge >= SIZE || uAge >= m_uTotal)
+			return NULL;
+		return &m_aRecords[(m_uTotal - 1 - uAge) % SIZE];
+	}
+
+	const CIdentLatencyHistogram& GetTimeToQueryUs() const { return m_timeToQuery; }
+	const CIdentLatencyHistogram& GetTimeToConnectedUs() const { return m_timeToConnected; }
+	const CIdentLatencyHistogram& GetReplyLatencyNs() const { return m_replyLatency; }
+};
+
+/************************************************************************/
+/*   SOCKET INDEX                                                       */
+/************************************************************************/
+
+/**
+* What an IDENT query names: the local end of an outgoing IRC connection
+* plus the server port it connected to.
+**/
+struct CIdentSockKey
+{
+	CIdentAddr localAddr;
+	unsigned short uLocalPort;
+	unsigned short uRemotePort;
+
+	bool operator==(const CIdentSockKey& other) const
+	{
+		return uLocalPort == other.uLocalPort && uRemotePort == other.uRemotePort && localAddr == other.localAddr;
+	}
+};
+
+struct CIdentSockKeyHash
+{
+	size_t operator()(const CIdentSockKey& key) const
+	{
+		return key.localAddr.Hash() ^ (((size_t)key.uLocalPort << 16) | key.uRemotePort);
+	}
+};
+
+/**
+* Key for the fallback match: the querying host is assumed to be the IRC
+* server, so match on the server end of the connection instead.
+**/
+struct CIdentPeerKey
+{
+	CIdentAddr remoteAddr;
+	unsigned short uRemotePort;
+	CIdentAddr localAddr;
+
+	bool operator==(const CIdentPeerKey& other) const
+	{
+		return uRemotePort == other.uRemotePort && remoteAddr == other.remoteAddr && localAddr == other.localAddr;
+	}
+};
+
+struct CIdentPeerKeyHash
+{
+	size_t operator()(const CIdentPeerKey& key) const
+	{
+		return (key.remoteAddr.Hash() * 31 + key.localAddr.Hash()) ^ key.uRemotePort;
+	}
+};
+
+struct CIdentAddrHash
+{
+	size_t operator()(const CIdentAddr& addr) const { return addr.Hash(); }
+};
+
+/**
+* Index of connected sockets by CIdentSockKey (exact match) and by
+* CIdentPeerKey (fallback match), so a query doesn't have to walk every
+* network of every user. It is partitioned by local address: a query only
+* ever looks at connections made from the address it arrived on, and one
+* for an address nothing connected from costs a single lookup.
+* Connections to different servers can share an exact key (Linux hands out
+* the same ephemeral port again as long as the destination differs), those
+* are told apart by the address the query came from.
+* TTraits tells the index about the networks it holds:
+*   static TSock *GetSock(const TNetwork*) - the network's current socket,
+*     entries whose socket changed since Add are stale and get dropped;
+*   static bool IsAfterInScanOrder(const TNetwork*, const TNetwork*) - picks
+*     between several fallback candidates.
+**/
+template<typename TNetwork, typename TSock, typename TTraits>
+class TIdentSockIndex
+{
+public:
+	struct CEntry
+	{
+		TNetwork *pNetwork;
+		const TSock *pSock;
+		CIdentUserIdCache userId;
+	};
+
+	struct CKeys
+	{
+		CIdentSockKey exact;
+		CIdentPeerKey peer;
+	};
+
+protected:
+	/** the exact key within a partition **/
+	struct CPortKey
+	{
+		unsigned short uLocalPort;
+		unsigned short uRemotePort;
+
+		bool operator==(const CPortKey& other) const { return uLocalPort == other.uLocalPort && uRemotePort == other.uRemotePort; }
+	};
+
+	struct CPortKeyHash
+	{
+		size_t operator()(const CPortKey& key) const { return ((size_t)key.uLocalPort << 16) | key.uRemotePort; }
+	};
+
+	/** the fallback key within a partition **/
+	struct CServerKey
+	{
+		CIdentAddr remoteAddr;
+		unsigned short uRemotePort;
+
+		bool operator==(const CServerKey& other) const { return uRemotePort == other.uRemotePort && remoteAddr == other.remoteAddr; }
+	};
+
+	struct CServerKeyHash
+	{
+		size_t operator()(const CServerKey& key) const { return key.remoteAddr.Hash() ^ key.uRemotePort; }
+	};
+
+	struct CPartition
+	{
+		std::unordered_multimap<CPortKey, CEntry, CPortKeyHash> exact;
+		// several networks may be connected to the same server from the same address:
+		std::unordered_map<CServerKey, std::vector<CEntry>, CServerKeyHash> fallback;
+	};
+
+	std::unordered_map<CIdentAddr, CPartition, CIdentAddrHash> m_partitions;
+	std::map<TNetwork*, CKeys> m_byNetwork;
+	std::vector<TNetwork*> m_vStale;
+
+	static CPortKey MakePortKey(unsigned short uLocalPort, unsigned short uRemotePort)
+	{
+		CPortKey key;
+		key.uLocalPort = uLocalPort;
+		key.uRemotePort = uRemotePort;
+		return key;
+	}
+
+	static CServerKey MakeServerKey(const CIdentAddr& remoteAddr, unsigned short uRemotePort)
+	{
+		CServerKey key;
+		key.remoteAddr = remoteAddr;
+		key.uRemotePort = uRemotePort;
+		return key;
+	}
+
+	void RemoveFallback(CPartition& partition, const CServerKey& key, const TNetwork *pNetwork)
+	{
+		auto it = partition.fallback.find(key);
+
+		if(it == partition.fallback.end())
+		{
+			return;
+		}
+
+		std::vector<CEntry>& vCandidates = it->second;
+
+		for(size_t i = 0; i < vCandidates.size(); i++)
+		{
+			if(vCandidates[i].pNetwork == pNetwork)
+			{
+				vCandidates[i] = vCandidates.back();
+				vCandidates.pop_back();
+				break;
+			}
+		}
+
+		if(vCandidates.empty())
+		{
+			partition.fallback.erase(it);
+		}
+	}
+
+	/** whether pNetwork's connection goes to remoteAddr **/
+	bool IsConnectedTo(const TNetwork *pNetwork, const CIdentAddr& remoteAddr) const
+	{
+		auto it = m_byNetwork.find(const_cast<TNetwork*>(pNetwork));
+		return it != m_byNetwork.end() && it->second.peer.remoteAddr == remoteAddr;
+	}
+
+	/** called once an entry is in the index, and before one leaves it **/
+	virtual void OnEntryAdded(const CEntry& /*entry*/, const CKeys& /*keys*/) {}
+	virtual void OnEntryRemoved(TNetwork * /*pNetwork*/, const CKeys& /*keys*/) {}
+public:
+	virtual ~TIdentSockIndex() {}
+
+	void Add(TNetwork *pNetwork, const TSock *pSock, const CIdentAddr& localAddr, unsigned short uLocalPort, const CIdentAddr& remoteAddr, unsigned short uRemotePort,
+		const CIdentUserIdCache& userId = CIdentUserIdCache())
+	{
+		Remove(pNetwork);
+
+		CKeys keys;
+		keys.exact.localAddr = localAddr;
+		keys.exact.uLocalPort = uLocalPort;
+		keys.exact.uRemotePort = uRemotePort;
+		keys.peer.remoteAddr = remoteAddr;
+		keys.peer.uRemotePort = uRemotePort;
+		keys.peer.localAddr = localAddr;
+
+		const CPortKey portKey = MakePortKey(uLocalPort, uRemotePort);
+
+		auto itp = m_partitions.find(localAddr);
+		if(itp != m_partitions.end())
+		{
+			auto range = itp->second.exact.equal_range(portKey);
+			for(auto it = range.first; it != range.second; ++it)
+			{
+				if(IsConnectedTo(it->second.pNetwork, remoteAddr))
+				{
+					// the same 4-tuple can't be in use twice, so the other network's socket is gone:
+					Remove(it->second.pNetwork);
+					break;
+				}
+			}
+		}
+
+		CEntry newEntry;
+		newEntry.pNetwork = pNetwork;
+		newEntry.pSock = pSock;
+		newEntry.userId = userId;
+
+		CPartition& partition = m_partitions[localAddr];
+		partition.exact.emplace(portKey, newEntry);
+		partition.fallback[MakeServerKey(remoteAddr, uRemotePort)].push_back(newEntry);
+		m_byNetwork[pNetwork] = keys;
+
+		OnEntryAdded(newEntry, keys);
+	}
+
+	bool Remove(TNetwork *pNetwork)
+	{
+		auto it = m_byNetwork.find(pNetwork);
+
+		if(it == m_byNetwork.end())
+		{
+			return false;
+		}
+
+		OnEntryRemoved(pNetwork, it->second);
+
+		const CKeys& keys = it->second;
+		auto itp = m_partitions.find(keys.exact.localAddr);
+
+		if(itp != m_partitions.end())
+		{
+			CPartition& partition = itp->second;
+
+			auto range = partition.exact.equal_range(MakePortKey(keys.exact.uLocalPort, keys.exact.uRemotePort));
+			for(auto ite = range.first; ite != range.second; ++ite)
+			{
+				if(ite->second.pNetwork == pNetwork)
+				{
+					partition.exact.erase(ite);
+					break;
+				}
+			}
+			RemoveFallback(partition, MakeServerKey(keys.peer.remoteAddr, keys.peer.uRemotePort), pNetwork);
+
+			if(partition.exact.empty() && partition.fallback.empty())
+			{
+				m_partitions.erase(itp);
+			}
+		}
+
+		m_byNetwork.erase(it);
+
+		return true;
+	}
+
+	TNetwork *Find(const CIdentAddr& localAddr, unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& remoteAddr, bool& bExact)
+	{
+		CEntry *pEntry = FindEntry(localAddr, uLocalPort, uRemotePort, remoteAddr, bExact);
+		return pEntry ? pEntry->pNetwork : NULL;
+	}
+
+	/** Find, but returns the entry, valid until the index is changed **/
+	CEntry *FindEntry(const CIdentAddr& localAddr, unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& remoteAddr, bool& bExact)
+	{
+		bExact = false;
+
+		auto itp = m_partitions.find(localAddr);
+
+		if(itp == m_partitions.end())
+		{
+			return NULL;
+		}
+
+		auto range = itp->second.exact.equal_range(MakePortKey(uLocalPort, uRemotePort));
+		CEntry *pExact = NULL;
+
+		for(auto it = range.first; it != range.second; ++it)
+		{
+			CEntry& entry = it->second;
+
+			if(TTraits::GetSock(entry.pNetwork) != entry.pSock)
+			{
+				m_vStale.push_back(entry.pNetwork);
+			}
+			else if(!pExact || (!IsConnectedTo(pExact->pNetwork, remoteAddr) && IsConnectedTo(entry.pNetwork, remoteAddr)))
+			{
+				// several connections from this port, prefer the one to where the query came from:
+				pExact = &entry;
+			}
+		}
+
+		if(!m_vStale.empty())
+		{
+			// missed a disconnect, don't trust the entries (this may drop the partition):
+			for(TNetwork *pStale : m_vStale)
+			{
+				Remove(pStale);
+			}
+			m_vStale.clear();
+
+			return FindEntry(localAddr, uLocalPort, uRemotePort, remoteAddr, bExact);
+		}
+
+		if(pExact)
+		{
+			bExact = true;
+			return pExact;
+		}
+
+		const CServerKey serverKey = MakeServerKey(remoteAddr, uRemotePort);
+		auto itf = itp->second.fallback.find(serverKey);
+
+		if(itf == itp->second.fallback.end())
+		{
+			return NULL;
+		}
+
+		CEntry *pFound = NULL;
+
+		for(CEntry& entry : itf->second)
+		{
+			if(TTraits::GetSock(entry.pNetwork) != entry.pSock)
+			{
+				m_vStale.push_back(entry.pNetwork);
+			}
+			else if(!pFound || TTraits::IsAfterInScanOrder(entry.pNetwork, pFound->pNetwork))
+			{
+				pFound = &entry;
+			}
+		}
+
+		if(m_vStale.empty())
+		{
+			return pFound;
+		}
+
+		// invalidates itp, itf and pFound:
+		TNetwork *pFoundNetwork = pFound ? pFound->pNetwork : NULL;
+
+		for(TNetwork *pStale : m_vStale)
+		{
+			Remove(pStale);
+		}
+		m_vStale.clear();
+
+		if(!pFoundNetwork)
+		{
+			return NULL;
+		}
+
+		// pFoundNetwork is still in, so are its partition and candidate list:
+		for(CEntry& entry : m_partitions[localAddr].fallback[serverKey])
+		{
+			if(entry.pNetwork == pFoundNetwork)
+				return &entry;
+		}
+
+		return NULL;
+	}
+
+	size_t GetSize() const { return m_byNetwork.size(); }
+	bool Contains(TNetwork *pNetwork) const { return m_byNetwork.count(pNetwork) != 0; }
+	/** number of local addresses there are connections from **/
+	size_t GetPartitionCount() const { return m_partitions.size(); }
+
+	/** f(TNetwork*, const CKeys&) for every network in the index **/
+	template<typename F>
+	void ForEach(F f) const
+	{
+		for(const auto& it : m_byNetwork)
+			f(it.first, it.second);
+	}
+};
+
+/************************************************************************/
+/*   INDEX SNAPSHOT                                                     */
+/************************************************************************/
+
+/**
+* A read-only copy of a TIdentSockIndex that another thread answers from
+* without ever waiting for the index's thread. It is split into SHARDS
+* immutable hash maps behind shared_ptrs. The index's thread replaces a whole
+* shard when one of its entries changes, and readers keep alive whatever
+* shard they loaded. (libstdc++'s shared_ptr atomic_load/atomic_store take a
+* pooled mutex, but only for the pointer copy.)
+* Entries hold the finished "UNIX : <ident>" text. Fallback keys map
+* straight to the candidate the index would have picked. An exact key can
+* have several entries, like in the index.
+**/
+class CIdentSnapshot
+{
+public:
+	enum { SHARDS = 64 };
+
+	struct CExactAnswer
+	{
+		CIdentAddr remoteAddr;
+		std::string sUserId;
+	};
+
+	typedef std::unordered_multimap<CIdentSockKey, CExactAnswer, CIdentSockKeyHash> CExactShard;
+	typedef std::unordered_map<CIdentPeerKey, std::string, CIdentPeerKeyHash> CPeerShard;
+
+protected:
+	std::shared_ptr<const CExactShard> m_apExact[SHARDS];
+	std::shared_ptr<const CPeerShard> m_apPeer[SHARDS];
+
+	static size_t Shard(uint64_t uHash)
+	{
+		// the key hashes hardly vary in their low bits (a few server ports, a few bind hosts):
+		uHash ^= uHash >> 33;
+		uHash *= 0xff51afd7ed558ccdULL;
+		uHash ^= uHash >> 33;
+		return (size_t)(uHash % SHARDS);
+	}
+
+public:
+	CIdentSnapshot()
+	{
+		for(size_t i = 0; i < SHARDS; i++)
+		{
+			m_apExact[i] = std::make_shared<const CExactShard>();
+			m_apPeer[i] = std::make_shared<const CPeerShard>();
+		}
+	}
+
+	static size_t GetShard(const CIdentSockKey& key) { return Shard(CIdentSockKeyHash()(key)); }
+	static size_t GetShard(const CIdentPeerKey& key) { return Shard(CIdentPeerKeyHash()(key)); }
+
+	void Publish(size_t uShard, std::shared_ptr<const CExactShard> pShard) { std::atomic_store(&m_apExact[uShard], pShard); }
+	void Publish(size_t uShard, std::shared_ptr<const CPeerShard> pShard) { std::atomic_store(&m_apPeer[uShard], pShard); }
+
+	/** formats the USERID reply into Reply, false if neither key is known. Thread safe. **/
+	bool Answer(const CIdentAddr& localAddr, unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& remoteAddr,
+		CIdentReplyWriter& Reply, bool& bExact) const
+	{
+		CIdentSockKey key;
+		key.localAddr = localAddr;
+		key.uLocalPort = uLocalPort;
+		key.uRemotePort = uRemotePort;
+
+		const std::shared_ptr<const CExactShard> pExact = std::atomic_load(&m_apExact[GetShard(key)]);
+		auto range = pExact->equal_range(key);
+		const CExactAnswer *pFound = NULL;
+
+		for(auto it = range.first; it != range.second; ++it)
+		{
+			if(!pFound || it->second.remoteAddr == remoteAddr)
+				pFound = &it->second;
+		}
+
+		if(pFound)
+		{
+			bExact = true;
+			Reply.FormatUserIdText(uLocalPort, uRemotePort, pFound->sUserId.data(), pFound->sUserId.size());
+			return true;
+		}
+
+		CIdentPeerKey peer;
+		peer.remoteAddr = remoteAddr;
+		peer.uRemotePort = uRemotePort;
+		peer.localAddr = localAddr;
+
+		const std::shared_ptr<const CPeerShard> pPeer = std::atomic_load(&m_apPeer[GetShard(peer)]);
+		auto itp = pPeer->find(peer);
+
+		if(itp != pPeer->end())
+		{
+			bExact = false;
+			Reply.FormatUserIdText(uLocalPort, uRemotePort, itp->second.data(), itp->second.size());
+			return true;
+		}
+
+		return false;
+	}
+};
+
+/**
+* Keeps a CIdentSnapshot in step with a TIdentSockIndex, on the index's
+* thread. It holds the master copy of every shard, so a change costs one
+* shard's worth of copying and not the whole index. Between BeginBatch()
+* and EndBatch() changed shards are only marked, then published once.
+* TTraits::IsAfterInScanOrder picks the fallback answer, like the index does.
+**/
+template<typename TNetwork, typename TTraits>
+class TIdentSnapshotPublisher
+{
+protected:
+	struct CCandidate
+	{
+		TNetwork *pNetwork;
+		std::string sUserId;
+		CIdentAddr remoteAddr;
+	};
+
+	enum { SHARDS = CIdentSnapshot::SHARDS };
+
+	CIdentSnapshot m_snapshot;
+	std::unordered_multimap<CIdentSockKey, CCandidate, CIdentSockKeyHash> m_aExact[SHARDS];
+	std::unordered_map<CIdentPeerKey, std::vector<CCandidate>, CIdentPeerKeyHash> m_aPeer[SHARDS];
+	bool m_abExactDirty[SHARDS];
+	bool m_abPeerDirty[SHARDS];
+	unsigned int m_uBatch;
+
+	void PublishExact(size_t uShard)
+	{
+		auto pShard = std::make_shared<CIdentSnapshot::CExactShard>();
+		pShard->reserve(m_aExact[uShard].size());
+
+		for(const auto& it : m_aExact[uShard])
+		{
+			CIdentSnapshot::CExactAnswer answer;
+			answer.remoteAddr = it.second.remoteAddr;
+			answer.sUserId = it.second.sUserId;
+			pShard->emplace(it.first, std::move(answer));
+		}
+
+		m_snapshot.Publish(uShard, std::shared_ptr<const CIdentSnapshot::CExactShard>(std::move(pShard)));
+		m_abExactDirty[uShard] = false;
+	}
+
+	void PublishPeer(size_t uShard)
+	{
+		auto pShard = std::make_shared<CIdentSnapshot::CPeerShard>();
+		pShard->reserve(m_aPeer[uShard].size());
+
+		for(const auto& it : m_aPeer[uShard])
+		{
+			const CCandidate *pFound = NULL;
+
+			for(const CCandidate& candidate : it.second)
+			{
+				if(!pFound || TTraits::IsAfterInScanOrder(candidate.pNetwork, pFound->pNetwork))
+					pFound = &candidate;
+			}
+
+			if(pFound)
+				pShard->emplace(it.first, pFound->sUserId);
+		}
+
+		m_snapshot.Publish(uShard, std::shared_ptr<const CIdentSnapshot::CPeerShard>(std::move(pShard)));
+		m_abPeerDirty[uShard] = false;
+	}
+
+	void Changed()
+	{
+		if(m_uBatch == 0)
+			Flush();
+	}
+
+	template<typename F>
+	static bool Update(CCandidate& candidate, F& fUserId)
+	{
+		std::string sUserId = fUserId(candidate.pNetwork);
+
+		if(sUserId == candidate.sUserId)
+			return false;
+
+		candidate.sUserId.swap(sUserId);
+		return true;
+	}
+
+public:
+	TIdentSnapshotPublisher() : m_uBatch(0)
+	{
+		for(size_t i = 0; i < SHARDS; i++)
+			m_abExactDirty[i] = m_abPeerDirty[i] = false;
+	}
+
+	const CIdentSnapshot& GetSnapshot() const { return m_snapshot; }
+
+	void Add(TNetwork *pNetwork, const CIdentSockKey& exact, const CIdentPeerKey& peer, const std::string& sUserId)
+	{
+		CCandidate candidate;
+		candidate.pNetwork = pNetwork;
+		candidate.sUserId = sUserId;
+		candidate.remoteAddr = peer.remoteAddr;
+
+		const size_t uExactShard = CIdentSnapshot::GetShard(exact);
+		const size_t uPeerShard = CIdentSnapshot::GetShard(peer);
+
+		m_aExact[uExactShard].emplace(exact, candidate);
+		m_aPeer[uPeerShard][peer].push_back(candidate);
+		m_abExactDirty[uExactShard] = m_abPeerDirty[uPeerShard] = true;
+
+		Changed();
+	}
+
+	void Remove(TNetwork *pNetwork, const CIdentSockKey& exact, const CIdentPeerKey& peer)
+	{
+		const size_t uExactShard = CIdentSnapshot::GetShard(exact);
+		const size_t uPeerShard = CIdentSnapshot::GetShard(peer);
+
+		auto range = m_aExact[uExactShard].equal_range(exact);
+		for(auto it = range.first; it != range.second; ++it)
+		{
+			if(it->second.pNetwork == pNetwork)
+			{
+				m_aExact[uExactShard].erase(it);
+				m_abExactDirty[uExactShard] = true;
+				break;
+			}
+		}
+
+		auto itp = m_aPeer[uPeerShard].find(peer);
+		if(itp != m_aPeer[uPeerShard].end())
+		{
+			std::vector<CCandidate>& vCandidates = itp->second;
+
+			for(size_t i = 0; i < vCandidates.size(); i++)
+			{
+				if(vCandidates[i].pNetwork == pNetwork)
+				{
+					vCandidates[i] = std::move(vCandidates.back());
+					vCandidates.pop_back();
+					m_abPeerDirty[uPeerShard] = true;
+					break;
+				}
+			}
+
+			if(vCandidates.empty())
+				m_aPeer[uPeerShard].erase(itp);
+		}
+
+		Changed();
+	}
+
+	/**
+	* fUserId(const TNetwork*) returns the current text for every network,
+	* only shards where one changed are published again.
+	**/
+	template<typename F>
+	void Refresh(F fUserId)
+	{
+		for(size_t i = 0; i < SHARDS; i++)
+		{
+			for(auto& it : m_aExact[i])
+				m_abExactDirty[i] |= Update(it.second, fUserId);
+
+			for(auto& it : m_aPeer[i])
+			{
+				for(CCandidate& candidate : it.second)
+					m_abPeerDirty[i] |= Update(candidate, fUserId);
+			}
+		}
+
+		Changed();
+	}
+
+	void Clear()
+	{
+		for(size_t i = 0; i < SHARDS; i++)
+		{
+			m_aExact[i].clear();
+			m_aPeer[i].clear();
+			m_abExactDirty[i] = m_abPeerDirty[i] = true;
+		}
+
+		Changed();
+	}
+
+	void BeginBatch() { m_uBatch++; }
+
+	void EndBatch()
+	{
+		if(m_uBatch > 0 && --m_uBatch == 0)
+			Flush();
+	}
+
+	void Flush()
+	{
+		for(size_t i = 0; i < SHARDS; i++)
+		{
+			if(m_abExactDirty[i])
+				PublishExact(i);
+			if(m_abPeerDirty[i])
+				PublishPeer(i);
+		}
+	}
+};
+
+/************************************************************************/
+/*   KERNEL SOCKET LOOKUP                                               */
+/************************************************************************/
+
+/**
+* Asks the kernel's TCP table (NETLINK_SOCK_DIAG) which socket has a
+* given 4-tuple, and gets back its inode. fstat() on a socket fd returns
+* the same inode, which is how a match is tied back to a connection.
+* One request, one reply; no dump of the whole table. It runs on ZNC's main
+* loop, so callers ask TakeToken first and skip the lookup once the
+* per-second budget (SetRate) is spent.
+**/
+class CIdentSockDiag
+{
+protected:
+	int m_iFd;
+	uint32_t m_uSeq;
+	unsigned int m_uRate;
+	uint64_t m_uMilliTokens;
+	uint64_t m_uLastMs;
+	uint64_t m_uSkipped;
+
+	bool Query(int iFamily, const CIdentAddr& localAddr, unsigned short uLocalPort, const CIdentAddr& remoteAddr, unsigned short uRemotePort, uint64_t& uInode)
+	{
+		struct
+		{
+			nlmsghdr nlh;
+			inet_diag_req_v2 req;
+		} msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.nlh.nlmsg_len = sizeof(msg);
+		msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+		msg.nlh.nlmsg_flags = NLM_F_REQUEST;
+		msg.nlh.nlmsg_seq = ++m_uSeq;
+		msg.req.sdiag_family = (uint8_t)iFamily;
+		msg.req.sdiag_protocol = IPPROTO_TCP;
+		msg.req.idiag_states = ~0u;
+		msg.req.id.idiag_sport = htons(uLocalPort);
+		msg.req.id.idiag_dport = htons(uRemotePort);
+		msg.req.id.idiag_cookie[0] = msg.req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+		if(iFamily == AF_INET)
+		{
+			memcpy(msg.req.id.idiag_src, &localAddr.addr.s6_addr[12], 4);
+			memcpy(msg.req.id.idiag_dst, &remoteAddr.addr.s6_addr[12], 4);
+		}
+		else
+		{
+			memcpy(msg.req.id.idiag_src, localAddr.addr.s6_addr, 16);
+			memcpy(msg.req.id.idiag_dst, remoteAddr.addr.s6_addr, 16);
+		}
+
+		sockaddr_nl nladdr;
+		memset(&nladdr, 0, sizeof(nladdr));
+		nladdr.nl_family = AF_NETLINK;
+
+		if(sendto(m_iFd, &msg, sizeof(msg), 0, reinterpret_cast<sockaddr*>(&nladdr), sizeof(nladdr)) < 0)
+			return false;
+
+		for(;;)
+		{
+			// aligned for the nlmsghdr casts
+			uint32_t auBuf[2048];
+			const ssize_t iLen = recv(m_iFd, auBuf, sizeof(auBuf), 0);
+
+			if(iLen < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				// including the receive timeout, a later reply is told apart by its sequence number:
+				return false;
+			}
+
+			int iLeft = (int)iLen;
+			for(const nlmsghdr *pHdr = reinterpret_cast<const nlmsghdr*>(auBuf); NLMSG_OK(pHdr, iLeft); pHdr = NLMSG_NEXT(pHdr, iLeft))
+			{
+				if(pHdr->nlmsg_seq != m_uSeq)
+					continue;
+
+				if(pHdr->nlmsg_type == SOCK_DIAG_BY_FAMILY)
+				{
+					const inet_diag_msg *pDiag = static_cast<const inet_diag_msg*>(NLMSG_DATA(pHdr));
+					uInode = pDiag->idiag_inode;
+					// 0 for TIME_WAIT leftovers, which belong to nobody
+					return uInode != 0;
+				}
+
+				// NLMSG_ERROR, ENOENT if there's no such socket
+				return false;
+			}
+		}
+	}
+
+public:
+	CIdentSockDiag() : m_iFd(-1), m_uSeq(0), m_uRate(0), m_uMilliTokens(0), m_uLastMs(0), m_uSkipped(0) {}
+	~CIdentSockDiag() { Close(); }
+
+	bool Open(std::string& sError)
+	{
+		if(m_iFd >= 0)
+			return true;
+
+		m_iFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+		if(m_iFd < 0)
+		{
+			sError = std::string("NETLINK_SOCK_DIAG: ") + strerror(errno);
+			return false;
+		}
+
+		// this runs on ZNC's main loop, never wait long for the kernel (it
+		// normally answers within microseconds):
+		timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 10 * 1000;
+		setsockopt(m_iFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		return true;
+	}
+
+	void Close()
+	{
+		if(m_iFd >= 0)
+			close(m_iFd);
+		m_iFd = -1;
+	}
+
+	bool IsOpen() const { return m_iFd >= 0; }
+
+	/** at most uPerSecond lookups a second, as a burst too; 0 = no limit **/
+	void SetRate(unsigned int uPerSecond)
+	{
+		m_uRate = uPerSecond;
+		m_uMilliTokens = 1000ULL * uPerSecond;
+		m_uLastMs = IdentNowMs();
+	}
+
+	unsigned int GetRate() const { return m_uRate; }
+	/** lookups TakeToken turned down **/
+	uint64_t GetSkipped() const { return m_uSkipped; }
+
+	/** false if this second's lookups are used up, counted in GetSkipped **/
+	bool TakeToken()
+	{
+		if(m_uRate == 0)
+			return true;
+
+		const uint64_t uNowMs = IdentNowMs();
+		const uint64_t uMaxTokens = 1000ULL * m_uRate;
+
+		m_uMilliTokens += (uNowMs - m_uLastMs) * m_uRate;
+		if(m_uMilliTokens > uMaxTokens)
+			m_uMilliTokens = uMaxTokens;
+		m_uLastMs = uNowMs;
+
+		if(m_uMilliTokens < 1000)
+		{
+			m_uSkipped++;
+			return false;
+		}
+
+		m_uMilliTokens -= 1000;
+		return true;
+	}
+
+	/** the inode of the TCP socket with this 4-tuple, false if there's none **/
+	bool Lookup(const CIdentAddr& localAddr, unsigned short uLocalPort, const CIdentAddr& remoteAddr, unsigned short uRemotePort, uint64_t& uInode)
+	{
+		if(m_iFd < 0)
+			return false;
+
+		if(IN6_IS_ADDR_V4MAPPED(&localAddr.addr) && IN6_IS_ADDR_V4MAPPED(&remoteAddr.addr) &&
+			Query(AF_INET, localAddr, uLocalPort, remoteAddr, uRemotePort, uInode))
+		{
+			return true;
+		}
+
+		// IPv6, or IPv4 on a dual stack socket:
+		return Query(AF_INET6, localAddr, uLocalPort, remoteAddr, uRemotePort, uInode);
+	}
+
+	/** what Lookup returns for the socket behind iFd **/
+	static bool GetSocketInode(int iFd, uint64_t& uInode)
+	{
+		struct stat st;
+		if(iFd < 0 || fstat(iFd, &st) != 0 || !S_ISSOCK(st.st_mode))
+			return false;
+		uInode = (uint64_t)st.st_ino;
+		return true;
+	}
+};
+
+/************************************************************************/
+/*   EXPORT TABLE                                                       */
+/************************************************************************/
+
+/*
+* A memory-mapped file with the (local address, local port, remote port)
+* -> ident table, for an identd outside ZNC (e.g. a host-level one serving
+* several containers) to answer from without asking us. Layout, version 1,
+* all integers in host byte order:
+*
+*   offset 0:  CIdentExportHeader (IDENT_EXPORT_HEADER_SIZE bytes)
+*   offset IDENT_EXPORT_HEADER_SIZE: uSlotCount CIdentExportSlot's
+*     (IDENT_EXPORT_SLOT_SIZE bytes each)
+*
+* The slots are an open-addressing hash table. A key starts at slot
+* IdentExportHash(...) & (uSlotCount - 1) and probes forward by one,
+* wrapping around. The probe ends at the first EXPORT_SLOT_EMPTY slot;
+* EXPORT_SLOT_DELETED slots are skipped over. Several slots can have the
+* same key when connections from one local port go to different servers,
+* aRemoteAddr tells them apart.
+*
+* There is one writer. Readers never lock, they use seqlocks instead:
+*   - a slot's uSeq is odd while the writer changes that slot. Read uSeq,
+*     copy the slot, read uSeq again. If it was odd or has changed, copy it again.
+*   - uTableSeq in the header is odd while the writer rebuilds the whole
+*     table. Read it before and after a lookup. If it was odd or has changed,
+*     do the lookup again.
+* IdentExportLookup below does all of this.
+*
+* The file is always created under a temporary name and renamed into
+* place, so it never shrinks under a reader. When the writer goes away it
+* sets uWriterPid to 0 and unlinks the file. A reader that sees 0 there
+* (or a different inode at the path) should map the file again.
+* Ports and addresses are as ZNC's sockets see them, i.e. from inside the
+* container, before any NAT.
+*/
+
+enum
+{
+	IDENT_EXPORT_VERSION = 1,
+	IDENT_EXPORT_HEADER_SIZE = 64,
+	IDENT_EXPORT_SLOT_SIZE = 128,
+	IDENT_EXPORT_MAX_IDENT = 84
+};
+
+enum EIdentExportSlotState
+{
+	EXPORT_SLOT_EMPTY = 0, // never used, ends a probe
+	EXPORT_SLOT_USED = 1,
+	EXPORT_SLOT_DELETED = 2
+};
+
+struct CIdentExportHeader
+{
+	char acMagic[8]; // "IDENTSRV"
+	uint32_t uVersion; // IDENT_EXPORT_VERSION
+	uint32_t uHeaderSize; // IDENT_EXPORT_HEADER_SIZE, where the slots start
+	uint32_t uSlotSize; // IDENT_EXPORT_SLOT_SIZE
+	uint32_t uSlotCount; // a power of two
+	uint32_t uTableSeq; // odd while the whole table is rewritten
+	uint32_t uWriterPid; // 0 once the writer has closed the table
+	uint64_t uUpdated; // unix time of the last change
+	uint32_t uUsed; // EXPORT_SLOT_USED slots
+	uint32_t uDeleted; // EXPORT_SLOT_DELETED slots
+	char acReserved[16];
+};
+
+struct CIdentExportSlot
+{
+	uint32_t uSeq; // odd while the slot is being written
+	uint8_t uState; // EIdentExportSlotState
+	uint8_t uIdentLen;
+	uint16_t uLocalPort;
+	uint16_t uRemotePort;
+	uint16_t uReserved;
+	uint8_t aLocalAddr[16]; // IPv6, IPv4 as ::ffff:a.b.c.d
+	uint8_t aRemoteAddr[16]; // the IRC server
+	char acIdent[IDENT_EXPORT_MAX_IDENT]; // not terminated, longer idents are cut off
+};
+
+static_assert(sizeof(CIdentExportHeader) == IDENT_EXPORT_HEADER_SIZE, "export header layout");
+static_assert(sizeof(CIdentExportSlot) == IDENT_EXPORT_SLOT_SIZE, "export slot layout");
+
+/** 32 bit FNV-1a over the 16 address bytes, then both ports as big-endian 16 bit numbers **/
+static inline uint32_t IdentExportHash(const uint8_t *pLocalAddr, unsigned short uLocalPort, unsigned short uRemotePort)
+{
+	uint8_t aKey[20];
+	memcpy(aKey, pLocalAddr, 16);
+	aKey[16] = (uint8_t)(uLocalPort >> 8);
+	aKey[17] = (uint8_t)uLocalPort;
+	aKey[18] = (uint8_t)(uRemotePort >> 8);
+	aKey[19] = (uint8_t)uRemotePort;
+
+	uint32_t uHash = 2166136261u;
+	for(uint8_t uByte : aKey)
+	{
+		uHash ^= uByte;
+		uHash *= 16777619u;
+	}
+	return uHash;
+}
+
+/**
+* Reader side: looks a key up in a mapped table and copies the ident to
+* szIdent (IDENT_EXPORT_MAX_IDENT + 1 bytes, terminated). False if there's
+* no such connection or it didn't get a stable copy within a few tries.
+* If several slots have the key, the one whose server is pRemoteAddr (the
+* address the query came from) wins, otherwise the first one.
+**/
+static inline bool IdentExportLookup(const void *pMapping, const CIdentAddr& localAddr, unsigned short uLocalPort, unsigned short uRemotePort, char *szIdent,
+	const CIdentAddr *pRemoteAddr = NULL)
+{
+	const CIdentExportHeader *pHeader = static_cast<const CIdentExportHeader*>(pMapping);
+	const CIdentExportSlot *pSlots = reinterpret_cast<const CIdentExportSlot*>(static_cast<const char*>(pMapping) + pHeader->uHeaderSize);
+	const uint32_t uCount = pHeader->uSlotCount;
+	const uint8_t *pAddr = localAddr.addr.s6_addr;
+
+	for(int iTry = 0; iTry < 8; iTry++)
+	{
+		const uint32_t uTableSeq = __atomic_load_n(&pHeader->uTableSeq, __ATOMIC_ACQUIRE);
+		if(uTableSeq & 1)
+			continue;
+
+		bool bFound = false, bTorn = false;
+		uint32_t uIdx = IdentExportHash(pAddr, uLocalPort, uRemotePort) & (uCount - 1);
+
+		for(uint32_t uProbe = 0; uProbe < uCount; uProbe++, uIdx = (uIdx + 1) & (uCount - 1))
+		{
+			CIdentExportSlot copy;
+			const uint32_t uSeq = __atomic_load_n(&pSlots[uIdx].uSeq, __ATOMIC_ACQUIRE);
+			memcpy(&copy, &pSlots[uIdx], sizeof(copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if((uSeq & 1) || __atomic_load_n(&pSlots[uIdx].uSeq, __ATOMIC_RELAXED) != uSeq)
+			{
+				bTorn = true;
+				break;
+			}
+
+			if(copy.uState == EXPORT_SLOT_EMPTY)
+				break;
+
+			if(copy.uState == EXPORT_SLOT_USED && copy.uLocalPort == uLocalPort && copy.uRemotePort == uRemotePort &&
+				memcmp(copy.aLocalAddr, pAddr, 16) == 0)
+			{
+				const bool bPeer = pRemoteAddr && memcmp(copy.aRemoteAddr, pRemoteAddr->addr.s6_addr, 16) == 0;
+
+				if(!bFound || bPeer)
+				{
+					const size_t uLen = copy.uIdentLen < (size_t)IDENT_EXPORT_MAX_IDENT ? copy.uIdentLen : (size_t)IDENT_EXPORT_MAX_IDENT;
+					memcpy(szIdent, copy.acIdent, uLen);
+					szIdent[uLen] = '\0';
+					bFound = true;
+				}
+
+				if(!pRemoteAddr || bPeer)
+					break;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(bTorn || __atomic_load_n(&pHeader->uTableSeq, __ATOMIC_RELAXED) != uTableSeq)
+			continue;
+
+		return bFound;
+	}
+
+	return false;
+}
+
+/**
+* Writer side of the export file, see the layout above. Not thread safe,
+* one instance per file.
+**/
+class CIdentExportTable
+{
+protected:
+	std::string m_sPath;
+	int m_iFd;
+	void *m_pMapping;
+	size_t m_uMappingSize;
+	CIdentExportHeader *m_pHeader;
+	CIdentExportSlot *m_pSlots;
+	uint32_t m_uMask;
+
+	static void BeginWrite(uint32_t *pSeq)
+	{
+		__atomic_store_n(pSeq, *pSeq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	static void EndWrite(uint32_t *pSeq)
+	{
+		__atomic_store_n(pSeq, *pSeq + 1, __ATOMIC_RELEASE);
+	}
+
+	/** the slot holding the connection, or NONE; uFree gets where it would go **/
+	uint32_t FindSlot(const uint8_t *pAddr, unsigned short uLocalPort, unsigned short uRemotePort, const uint8_t *pRemoteAddr, uint32_t& uFree) const
+	{
+		const uint32_t NONE = ~0u;
+		uint32_t uIdx = IdentExportHash(pAddr, uLocalPort, uRemotePort) & m_uMask;
+		uFree = NONE;
+
+		for(uint32_t uProbe = 0; uProbe <= m_uMask; uProbe++, uIdx = (uIdx + 1) & m_uMask)
+		{
+			const CIdentExportSlot& slot = m_pSlots[uIdx];
+
+			if(slot.uState == EXPORT_SLOT_EMPTY)
+			{
+				if(uFree == NONE)
+					uFree = uIdx;
+				return NONE;
+			}
+
+			if(slot.uState == EXPORT_SLOT_DELETED)
+			{
+				if(uFree == NONE)
+					uFree = uIdx;
+			}
+			else if(slot.uLocalPort == uLocalPort && slot.uRemotePort == uRemotePort && memcmp(slot.aLocalAddr, pAddr, 16) == 0 &&
+				memcmp(slot.aRemoteAddr, pRemoteAddr, 16) == 0)
+			{
+				return uIdx;
+			}
+		}
+
+		return NONE;
+	}
+
+	void WriteSlot(uint32_t uIdx, const CIdentExportSlot& value)
+	{
+		CIdentExportSlot& slot = m_pSlots[uIdx];
+
+		BeginWrite(&slot.uSeq);
+		memcpy(reinterpret_cast<char*>(&slot) + sizeof(slot.uSeq), reinterpret_cast<const char*>(&value) + sizeof(value.uSeq), sizeof(slot) - sizeof(slot.uSeq));
+		EndWrite(&slot.uSeq);
+	}
+
+	/** squeezes out the deleted slots, so probes end early again **/
+	void Rebuild()
+	{
+		std::vector<CIdentExportSlot> vUsed;
+		vUsed.reserve(m_pHeader->uUsed);
+
+		for(uint32_t i = 0; i <= m_uMask; i++)
+		{
+			if(m_pSlots[i].uState == EXPORT_SLOT_USED)
+				vUsed.push_back(m_pSlots[i]);
+		}
+
+		BeginWrite(&m_pHeader->uTableSeq);
+
+		for(uint32_t i = 0; i <= m_uMask; i++)
+		{
+			m_pSlots[i].uState = EXPORT_SLOT_EMPTY;
+		}
+
+		for(const CIdentExportSlot& used : vUsed)
+		{
+			uint32_t uFree;
+			FindSlot(used.aLocalAddr, used.uLocalPort, used.uRemotePort, used.aRemoteAddr, uFree);
+			// uSeq stays even, nobody reads slots while uTableSeq is odd:
+			memcpy(reinterpret_cast<char*>(&m_pSlots[uFree]) + sizeof(used.uSeq), reinterpret_cast<const char*>(&used) + sizeof(used.uSeq), sizeof(used) - sizeof(used.uSeq));
+		}
+
+		m_pHeader->uUsed = (uint32_t)vUsed.size();
+		m_pHeader->uDeleted = 0;
+
+		EndWrite(&m_pHeader->uTableSeq);
+	}
+
+	void Touch()
+	{
+		__atomic_store_n(&m_pHeader->uUpdated, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+	}
+
+public:
+	CIdentExportTable() : m_iFd(-1), m_pMapping(NULL), m_uMappingSize(0), m_pHeader(NULL), m_pSlots(NULL), m_uMask(0) {}
+	~CIdentExportTable() { Close(); }
+
+	bool IsOpen() const { return m_pMapping != NULL; }
+	const std::string& GetPath() const { return m_sPath; }
+	uint32_t GetSlotCount() const { return m_pHeader ? m_pHeader->uSlotCount : 0; }
+	uint32_t GetUsed() const { return m_pHeader ? m_pHeader->uUsed : 0; }
+
+	/** creates an empty table of at least uSlots slots at sPath, replacing whatever is there **/
+	bool Open(const std::string& sPath, uint32_t uSlots, std::string& sError)
+	{
+		Close();
+
+		uint32_t uCount = 64;
+		while(uCount < uSlots && uCount < (1u << 24))
+			uCount *= 2;
+
+		const std::string sTmpPath = sPath + ".tmp";
+		const size_t uSize = IDENT_EXPORT_HEADER_SIZE + (size_t)uCount * IDENT_EXPORT_SLOT_SIZE;
+
+		m_iFd = open(sTmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(m_iFd < 0)
+		{
+			sError = sTmpPath + ": " + strerror(errno);
+			return false;
+		}
+
+		// the umask is not to decide whether the host's identd can read it:
+		fchmod(m_iFd, 0644);
+
+		if(ftruncate(m_iFd, (off_t)uSize) != 0)
+		{
+			sError = sTmpPath + ": " + strerror(errno);
+			close(m_iFd);
+			m_iFd = -1;
+			unlink(sTmpPath.c_str());
+			return false;
+		}
+
+		void *pMapping = mmap(NULL, uSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_iFd, 0);
+		if(pMapping == MAP_FAILED)
+		{
+			sError = sTmpPath + ": " + strerror(errno);
+			close(m_iFd);
+			m_iFd = -1;
+			unlink(sTmpPath.c_str());
+			return false;
+		}
+
+		// ftruncate left it all zero, i.e. every slot EXPORT_SLOT_EMPTY
+		m_pMapping = pMapping;
+		m_uMappingSize = uSize;
+		m_pHeader = static_cast<CIdentExportHeader*>(pMapping);
+		m_pSlots = reinterpret_cast<CIdentExportSlot*>(static_cast<char*>(pMapping) + IDENT_EXPORT_HEADER_SIZE);
+		m_uMask = uCount - 1;
+
+		m_pHeader->uVersion = IDENT_EXPORT_VERSION;
+		m_pHeader->uHeaderSize = IDENT_EXPORT_HEADER_SIZE;
+		m_pHeader->uSlotSize = IDENT_EXPORT_SLOT_SIZE;
+		m_pHeader->uSlotCount = uCount;
+		m_pHeader->uWriterPid = (uint32_t)getpid();
+		Touch();
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(m_pHeader->acMagic, "IDENTSRV", 8);
+
+		if(rename(sTmpPath.c_str(), sPath.c_str()) != 0)
+		{
+			sError = sPath + ": " + strerror(errno);
+			unlink(sTmpPath.c_str());
+			Close();
+			return false;
+		}
+
+		m_sPath = sPath;
+		return true;
+	}
+
+	/** marks the table closed for readers and removes the file **/
+	void Close()
+	{
+		if(!m_pMapping)
+			return;
+
+		__atomic_store_n(&m_pHeader->uWriterPid, 0, __ATOMIC_RELEASE);
+
+		if(!m_sPath.empty())
+			unlink(m_sPath.c_str());
+
+		munmap(m_pMapping, m_uMappingSize);
+		close(m_iFd);
+
+		m_iFd = -1;
+		m_pMapping = NULL;
+		m_pHeader = NULL;
+		m_pSlots = NULL;
+		m_sPath.clear();
+	}
+
+	/** adds the connection or changes its ident, false if the table is full **/
+	bool Set(const CIdentAddr& localAddr, unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& remoteAddr, const char *pIdent, size_t uIdentLen)
+	{
+		if(!IsOpen())
+			return false;
+
+		const uint8_t *pAddr = localAddr.addr.s6_addr;
+		uIdentLen = IdentSafeLength(pIdent, uIdentLen, IDENT_EXPORT_MAX_IDENT);
+
+		uint32_t uFree;
+		uint32_t uIdx = FindSlot(pAddr, uLocalPort, uRemotePort, remoteAddr.addr.s6_addr, uFree);
+
+		if(uIdx != ~0u)
+		{
+			const CIdentExportSlot& slot = m_pSlots[uIdx];
+
+			if(slot.uIdentLen == uIdentLen && memcmp(slot.acIdent, pIdent, uIdentLen) == 0)
+			{
+				return true;
+			}
+		}
+		else
+		{
+			// keep probes short, at most 3/4 of the slots in use or deleted:
+			if((uint64_t)(m_pHeader->uUsed + m_pHeader->uDeleted + 1) * 4 > (uint64_t)(m_uMask + 1) * 3)
+			{
+				if((uint64_t)(m_pHeader->uUsed + 1) * 4 > (uint64_t)(m_uMask + 1) * 3)
+					return false;
+
+				Rebuild();
+				FindSlot(pAddr, uLocalPort, uRemotePort, remoteAddr.addr.s6_addr, uFree);
+			}
+
+			uIdx = uFree;
+
+			if(m_pSlots[uIdx].uState == EXPORT_SLOT_DELETED)
+				m_pHeader->uDeleted--;
+			m_pHeader->uUsed++;
+		}
+
+		CIdentExportSlot value;
+		memset(&value, 0, sizeof(value));
+		value.uState = EXPORT_SLOT_USED;
+		value.uIdentLen = (uint8_t)uIdentLen;
+		value.uLocalPort = uLocalPort;
+		value.uRemotePort = uRemotePort;
+		memcpy(value.aLocalAddr, pAddr, 16);
+		memcpy(value.aRemoteAddr, remoteAddr.addr.s6_addr, 16);
+		memcpy(value.acIdent, pIdent, uIdentLen);
+
+		WriteSlot(uIdx, value);
+		Touch();
+
+		return true;
+	}
+
+	void Remove(const CIdentAddr& localAddr, unsigned short uLocalPort, unsigned short uRemotePort, const CIdentAddr& remoteAddr)
+	{
+		if(!IsOpen())
+			return;
+
+		uint32_t uFree;
+		const uint32_t uIdx = FindSlot(localAddr.addr.s6_addr, uLocalPort, uRemotePort, remoteAddr.addr.s6_addr, uFree);
+
+		if(uIdx == ~0u)
+			return;
+
+		CIdentExportSlot value = m_pSlots[uIdx];
+		value.uState = EXPORT_SLOT_DELETED;
+		WriteSlot(uIdx, value);
+
+		m_pHeader->uUsed--;
+		m_pHeader->uDeleted++;
+		Touch();
+	}
+};
+
+/************************************************************************/
+/*   LISTENER THREADS                                                   */
+/************************************************************************/
+
+/**
+* An IDENT server on threads of its own, each one a worker with a private
+* epoll loop, so queries get answered while ZNC's main loop is busy. Each
+* worker listens on every bind host. With more than one worker, each one
+* opens its own SO_REUSEPORT listeners and the kernel spreads connections
+* across their accept queues.
+* It answers from a CIdentSnapshot only. There is no scan of all networks,
+* so a query the snapshot can't match gets NO-USER.
+* The setters may be called from any thread. Limits apply to connections
+* accepted afterwards.
+**/
+class CIdentThreadServer
+{
+protected:
+	struct CConn
+	{
+		int iFd;
+		uint64_t uDeadlineMs;
+		CIdentAddr localAddr;
+		CIdentAddr remoteAddr;
+		unsigned int uQueries;
+		bool bDone; // no more queries, close once sOut is sent
+		bool bWantWrite;
+		std::string sIn;
+		std::string sOut;
+	};
+
+	/** everything but the settings belongs to the worker's thread **/
+	struct CWorker
+	{
+		std::thread thread;
+		std::vector<int> vListenFds;
+		int iEpollFd;
+		std::vector<CConn*> vConns; // by fd
+		std::vector<CConn*> vFree;
+		CIdentRateLimiter rateLimiter;
+		uint32_t uAppliedRateGeneration;
+		bool bAcceptPaused;
+
+		CWorker() : iEpollFd(-1), uAppliedRateGeneration(0), bAcceptPaused(false) {}
+	};
+
+	enum { SWEEP_MS = 250 };
+
+	// epoll_event.data.u64 is a connection's fd, or one of these:
+	static const uint64_t EVENT_LISTENER = 1ULL << 32; // | index into vListenFds
+	static const uint64_t EVENT_WAKE = 1ULL << 33;
+
+	const CIdentSnapshot& m_snapshot;
+	CIdentHistory& m_history;
+	CIdentMetrics& m_metrics;
+
+	std::vector<CWorker*> m_vWorkers;
+	std::atomic<bool> m_bStop;
+	int m_iWakeFd; // in every worker's epoll set, becomes readable to stop them all
+
+	std::atomic<bool> m_bAnswering;
+	std::atomic<unsigned int> m_uMaxClients;
+	std::atomic<unsigned int> m_uReadTimeout; // seconds
+	std::atomic<unsigned int> m_uMaxLineLength;
+	std::atomic<bool> m_bPipeline;
+	std::atomic<unsigned int> m_uMaxQueries;
+	std::atomic<unsigned int> m_uIdleTimeout; // seconds
+	std::atomic<unsigned int> m_uRate;
+	std::atomic<unsigned int> m_uBurst;
+	std::atomic<size_t> m_uRateCapacity;
+	std::atomic<uint32_t> m_uRateGeneration;
+
+	std::atomic<size_t> m_uOpen; // all workers together
+
+	void CloseFds()
+	{
+		for(CWorker *pWorker : m_vWorkers)
+		{
+			for(int iFd : pWorker->vListenFds)
+				close(iFd);
+			if(pWorker->iEpollFd >= 0)
+				close(pWorker->iEpollFd);
+			delete pWorker;
+		}
+		m_vWorkers.clear();
+
+		if(m_iWakeFd >= 0)
+			close(m_iWakeFd);
+		m_iWakeFd = -1;
+	}
+
+	static bool ResolveBindHost(const std::string& sBindHost, unsigned short uPort, sockaddr_storage& ss, socklen_t& uLen, std::string& sError)
+	{
+		memset(&ss, 0, sizeof(ss));
+
+		if(sBindHost.empty())
+		{
+			// dual stack, OpenListener falls back to IPv4 where IPv6 isn't there:
+			sockaddr_in6 *pAddr = reinterpret_cast<sockaddr_in6*>(&ss);
+			pAddr->sin6_family = AF_INET6;
+			pAddr->sin6_addr = in6addr_any;
+			pAddr->sin6_port = htons(uPort);
+			uLen = sizeof(*pAddr);
+			return true;
+		}
+
+		addrinfo hints, *pResult = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		const int iErr = getaddrinfo(sBindHost.c_str(), NULL, &hints, &pResult);
+		if(iErr != 0 || !pResult)
+		{
+			sError = "can't resolve " + sBindHost + ": " + gai_strerror(iErr);
+			return false;
+		}
+
+		memcpy(&ss, pResult->ai_addr, pResult->ai_addrlen);
+		uLen = (socklen_t)pResult->ai_addrlen;
+		freeaddrinfo(pResult);
+
+		if(ss.ss_family == AF_INET6)
+			reinterpret_cast<sockaddr_in6*>(&ss)->sin6_port = htons(uPort);
+		else
+			reinterpret_cast<sockaddr_in*>(&ss)->sin_port = htons(uPort);
+
+		return true;
+	}
+
+	static int OpenListener(sockaddr_storage ss, socklen_t uLen, bool bReusePort, unsigned int uBacklog, std::string& sError)
+	{
+		int iFd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+		if(iFd < 0 && ss.ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&reinterpret_cast<sockaddr_in6*>(&ss)->sin6_addr))
+		{
+			const unsigned short uPort = reinterpret_cast<sockaddr_in6*>(&ss)->sin6_port;
+
+			memset(&ss, 0, sizeof(ss));
+			sockaddr_in *pAddr = reinterpret_cast<sockaddr_in*>(&ss);
+			pAddr->sin_family = AF_INET;
+			pAddr->sin_addr.s_addr = htonl(INADDR_ANY);
+			pAddr->sin_port = uPort;
+			uLen = sizeof(*pAddr);
+
+			iFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		}
+
+		if(iFd < 0)
+		{
+			sError = std::string("socket: ") + strerror(errno);
+			return -1;
+		}
+
+		int iOn = 1, iOff = 0;
+		setsockopt(iFd, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+
+		if(ss.ss_family == AF_INET6)
+			setsockopt(iFd, IPPROTO_IPV6, IPV6_V6ONLY, &iOff, sizeof(iOff));
+
+		if(bReusePort && setsockopt(iFd, SOL_SOCKET, SO_REUSEPORT, &iOn, sizeof(iOn)) != 0)
+		{
+			sError = std::string("SO_REUSEPORT: ") + strerror(errno);
+			close(iFd);
+			return -1;
+		}
+
+		if(bind(iFd, reinterpret_cast<sockaddr*>(&ss), uLen) != 0)
+		{
+			sError = std::string("bind: ") + strerror(errno);
+			close(iFd);
+			return -1;
+		}
+
+		if(listen(iFd, (int)uBacklog) != 0)
+		{
+			sError = std::string("listen: ") + strerror(errno);
+			close(iFd);
+			return -1;
+		}
+
+		return iFd;
+	}
+
+	static void WatchListeners(CWorker& worker, bool bWatch)
+	{
+		for(size_t i = 0; i < worker.vListenFds.size(); i++)
+		{
+			epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u64 = EVENT_LISTENER | i;
+			epoll_ctl(worker.iEpollFd, bWatch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, worker.vListenFds[i], &ev);
+		}
+		worker.bAcceptPaused = !bWatch;
+	}
+
+	static void WatchConn(CWorker& worker, CConn *pConn, int iOp, uint32_t uEvents)
+	{
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = uEvents;
+		ev.data.u64 = (uint64_t)pConn->iFd;
+		epoll_ctl(worker.iEpollFd, iOp, pConn->iFd, &ev);
+	}
+
+	void CloseConn(CWorker& worker, CConn *pConn, bool bGraceful)
+	{
+		epoll_ctl(worker.iEpollFd, EPOLL_CTL_DEL, pConn->iFd, NULL);
+
+		if(bGraceful)
+			shutdown(pConn->iFd, SHUT_WR);
+		close(pConn->iFd);
+
+		worker.vConns[pConn->iFd] = NULL;
+		pConn->sIn.clear();
+		pConn->sOut.clear();
+		worker.vFree.push_back(pConn);
+		m_uOpen.fetch_sub(1, std::memory_order_relaxed);
+
+		if(worker.bAcceptPaused)
+			WatchListeners(worker, true);
+	}
+
+	void ApplyRateLimit(CWorker& worker)
+	{
+		const uint32_t uGeneration = m_uRateGeneration.load(std::memory_order_acquire);
+
+		if(worker.uAppliedRateGeneration == uGeneration)
+			return;
+
+		worker.uAppliedRateGeneration = uGeneration;
+
+		const size_t uCapacity = m_uRateCapacity.load(std::memory_order_relaxed);
+		if(worker.rateLimiter.GetCapacity() != uCapacity)
+			worker.rateLimiter.SetCapacity(uCapacity);
+
+		// the kernel spreads one host's connections over all workers, so each
+		// one allows its share of the rate (rounded up, never below 1/s):
+		const unsigned int uWorkers = (unsigned int)m_vWorkers.size();
+		const unsigned int uRate = m_uRate.load(std::memory_order_relaxed);
+		const unsigned int uBurst = m_uBurst.load(std::memory_order_relaxed);
+		worker.rateLimiter.SetRate((uRate + uWorkers - 1) / uWorkers, (uBurst + uWorkers - 1) / uWorkers);
+	}
+
+	void Accept(CWorker& worker, int iListenFd, uint64_t uNowMs)
+	{
+		ApplyRateLimit(worker);
+
+		for(;;)
+		{
+			sockaddr_storage ss;
+			socklen_t uLen = sizeof(ss);
+			const int iFd = accept4(iListenFd, reinterpret_cast<sockaddr*>(&ss), &uLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+			if(iFd < 0)
+			{
+				if(errno == EINTR || errno == ECONNABORTED)
+					continue;
+				if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+				{
+					// level triggered, so stop watching until a connection closes or the next sweep:
+					WatchListeners(worker, false);
+				}
+				return;
+			}
+
+			CIdentAddr remoteAddr;
+			remoteAddr.Set(reinterpret_cast<sockaddr*>(&ss));
+
+			if(!m_bAnswering.load(std::memory_order_relaxed))
+			{
+				close(iFd);
+				continue;
+			}
+
+			const unsigned int uMaxClients = m_uMaxClients.load(std::memory_order_relaxed);
+			if(uMaxClients > 0 && m_uOpen.load(std::memory_order_relaxed) >= uMaxClients)
+			{
+				m_metrics.refused.Inc();
+				close(iFd);
+				continue;
+			}
+
+			if(!worker.rateLimiter.Allow(remoteAddr, uNowMs))
+			{
+				m_metrics.rateLimited.Inc();
+				close(iFd);
+				continue;
+			}
+
+			uLen = sizeof(ss);
+			if(getsockname(iFd, reinterpret_cast<sockaddr*>(&ss), &uLen) != 0)
+			{
+				close(iFd);
+				continue;
+			}
+
+			CConn *pConn;
+			if(!worker.vFree.empty())
+			{
+				pConn = worker.vFree.back();
+				worker.vFree.pop_back();
+			}
+			else
+			{
+				pConn = new CConn;
+			}
+
+			pConn->iFd = iFd;
+			pConn->uDeadlineMs = uNowMs + 1000ULL * m_uReadTimeout.load(std::memory_order_relaxed);
+			pConn->localAddr.Set(reinterpret_cast<sockaddr*>(&ss));
+			pConn->remoteAddr = remoteAddr;
+			pConn->uQueries = 0;
+			pConn->bDone = false;
+			pConn->bWantWrite = false;
+
+			if((size_t)iFd >= worker.vConns.size())
+				worker.vConns.resize(iFd + 1, NULL);
+			worker.vConns[iFd] = pConn;
+			WatchConn(worker, pConn, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP);
+
+			m_uOpen.fetch_add(1, std::memory_order_relaxed);
+			m_metrics.accepted.Inc();
+		}
+	}
+
+	void Answer(CConn *pConn, const char *pLine, size_t uLineLen, uint64_t uNowMs)
+	{
+		const uint64_t uStartNs = IdentNowNs();
+
+		CIdentReplyWriter Reply;
+		unsigned short uLocalPort = 0, uRemotePort = 0;
+
+		m_metrics.queries.Inc();
+
+		switch(IdentParseRequest(pLine, uLineLen, uLocalPort, uRemotePort))
+		{
+		case IDENT_PARSE_OK:
+		{
+			bool bExact = false;
+
+			if(m_snapshot.Answer(pConn->localAddr, uLocalPort, uRemotePort, pConn->remoteAddr, Reply, bExact))
+			{
+				m_metrics.indexHits.Inc();
+				(bExact ? m_metrics.exactMatches : m_metrics.fallbackMatches).Inc();
+				m_metrics.replyUserId.Inc();
+			}
+			else
+			{
+				Reply.FormatError(uLocalPort, uRemotePort, "NO-USER");
+				m_metrics.replyNoUser.Inc();
+			}
+			break;
+		}
+		case IDENT_PARSE_INVALID_PORT:
+		case IDENT_PARSE_MALFORMED:
+			// same as CIdentServer::GetResponse, a malformed line gets "0, 0 : ERROR : INVALID-PORT":
+			Reply.FormatError(uLocalPort, uRemotePort, "INVALID-PORT");
+			m_metrics.replyInvalidPort.Inc();
+			break;
+		}
+
+		m_metrics.lookupLatency.Add(IdentNowNs() - uStartNs);
+
+		size_t uRequestLen = uLineLen;
+		while(uRequestLen > 0 && (pLine[uRequestLen - 1] == '\n' || pLine[uRequestLen - 1] == '\r'))
+			uRequestLen--;
+		m_history.Add(pLine, uRequestLen, pConn->localAddr, pConn->remoteAddr, Reply.GetData(), Reply.GetLineSize());
+
+		pConn->sOut.append(Reply.GetData(), Reply.GetSize());
+		pConn->uQueries++;
+
+		const unsigned int uMaxQueries = m_uMaxQueries.load(std::memory_order_relaxed);
+		if(!m_bPipeline.load(std::memory_order_relaxed) || (uMaxQueries > 0 && pConn->uQueries >= uMaxQueries))
+			pConn->bDone = true;
+		else
+			pConn->uDeadlineMs = uNowMs + 1000ULL * m_uIdleTimeout.load(std::memory_order_relaxed);
+	}
+
+	/** sends what's queued, false if pConn was closed **/
+	bool Flush(CWorker& worker, CConn *pConn)
+	{
+		while(!pConn->sOut.empty())
+		{
+			const ssize_t iSent = send(pConn->iFd, pConn->sOut.data(), pConn->sOut.size(), MSG_NOSIGNAL);
+
+			if(iSent < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					CloseConn(worker, pConn, false);
+					return false;
+				}
+				break;
+			}
+
+			pConn->sOut.erase(0, (size_t)iSent);
+		}
+
+		if(pConn->bDone && pConn->sOut.empty())
+		{
+			CloseConn(worker, pConn, true);
+			return false;
+		}
+
+		const bool bWantWrite = !pConn->sOut.empty();
+		if(bWantWrite != pConn->bWantWrite)
+		{
+			WatchConn(worker, pConn, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP | (bWantWrite ? (uint32_t)EPOLLOUT : 0));
+			pConn->bWantWrite = bWantWrite;
+		}
+
+		return true;
+	}
+
+	void Read(CWorker& worker, CConn *pConn, uint64_t uNowMs)
+	{
+		const size_t uMaxLineLength = m_uMaxLineLength.load(std::memory_order_relaxed);
+		bool bEof = false;
+
+		for(;;)
+		{
+			char szBuf[1024];
+			const ssize_t iRead = recv(pConn->iFd, szBuf, sizeof(szBuf), 0);
+
+			if(iRead > 0)
+			{
+				pConn->sIn.append(szBuf, (size_t)iRead);
+				if(pConn->sIn.size() > uMaxLineLength + sizeof(szBuf))
+					break;
+				continue;
+			}
+
+			if(iRead == 0)
+			{
+				bEof = true;
+				break;
+			}
+
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				CloseConn(worker, pConn, false);
+				return;
+			}
+			break;
+		}
+
+		size_t uStart = 0, uEol;
+		while(!pConn->bDone && (uEol = pConn->sIn.find('\n', uStart)) != std::string::npos)
+		{
+			if(uEol - uStart > uMaxLineLength)
+			{
+				m_metrics.overlong.Inc();
+				CloseConn(worker, pConn, false);
+				return;
+			}
+
+			Answer(pConn, pConn->sIn.data() + uStart, uEol + 1 - uStart, uNowMs);
+			uStart = uEol + 1;
+		}
+		pConn->sIn.erase(0, uStart);
+
+		if(!pConn->bDone && pConn->sIn.size() > uMaxLineLength)
+		{
+			m_metrics.overlong.Inc();
+			CloseConn(worker, pConn, false);
+			return;
+		}
+
+		if(bEof)
+			pConn->bDone = true;
+
+		Flush(worker, pConn);
+	}
+
+	void Sweep(CWorker& worker, uint64_t uNowMs)
+	{
+		for(CConn *pConn : worker.vConns)
+		{
+			if(pConn && pConn->uDeadlineMs <= uNowMs)
+				CloseConn(worker, pConn, false);
+		}
+	}
+
+	void Run(CWorker *pWorker)
+	{
+		CWorker& worker = *pWorker;
+		std::vector<epoll_event> vEvents(256);
+		uint64_t uNextSweepMs = IdentNowMs() + SWEEP_MS;
+
+		while(!m_bStop.load(std::memory_order_acquire))
+		{
+			const int iEvents = epoll_wait(worker.iEpollFd, &vEvents[0], (int)vEvents.size(), SWEEP_MS);
+			const uint64_t uNowMs = IdentNowMs();
+
+			for(int i = 0; i < iEvents; i++)
+			{
+				const uint64_t uData = vEvents[i].data.u64;
+
+				if(uData & EVENT_LISTENER)
+				{
+					Accept(worker, worker.vListenFds[uData & 0xffffffff], uNowMs);
+				}
+				else if(uData < worker.vConns.size() && worker.vConns[uData])
+				{
+					CConn *pConn = worker.vConns[uData];
+
+					if(vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+						Read(worker, pConn, uNowMs);
+					else if(vEvents[i].events & EPOLLOUT)
+						Flush(worker, pConn);
+				}
+				// else EVENT_WAKE, left readable for the other workers
+			}
+
+			if(uNowMs >= uNextSweepMs)
+			{
+				if(worker.bAcceptPaused)
+					WatchListeners(worker, true);
+				Sweep(worker, uNowMs);
+				uNextSweepMs = uNowMs + SWEEP_MS;
+			}
+		}
+
+		for(CConn *pConn : worker.vConns)
+		{
+			if(pConn)
+				CloseConn(worker, pConn, false);
+		}
+
+		for(CConn *pConn : worker.vFree)
+			delete pConn;
+		worker.vFree.clear();
+		worker.vConns.clear();
+	}
+
+public:
+	CIdentThreadServer(const CIdentSnapshot& snapshot, CIdentHistory& history, CIdentMetrics& metrics) :
+		m_snapshot(snapshot), m_history(history), m_metrics(metrics),
+		m_bStop(false), m_iWakeFd(-1),
+		m_bAnswering(false), m_uMaxClients(0), m_uReadTimeout(30), m_uMaxLineLength(1024),
+		m_bPipeline(false), m_uMaxQueries(0), m_uIdleTimeout(30),
+		m_uRate(0), m_uBurst(0), m_uRateCapacity(1024), m_uRateGeneration(1), m_uOpen(0)
+	{
+	}
+
+	~CIdentThreadServer()
+	{
+		Stop();
+	}
+
+	/**
+	* uWorkers, each listening on every one of vsBindHosts (an empty one or
+	* none at all means every address), with SO_REUSEPORT if more than one.
+	**/
+	bool Start(const std::vector<std::string>& vsBindHosts, unsigned short uPort, unsigned int uWorkers, unsigned int uBacklog, std::string& sError)
+	{
+		if(IsRunning())
+			return true;
+
+		if(uWorkers == 0)
+			uWorkers = 1;
+
+		std::vector<sockaddr_storage> vAddrs;
+		std::vector<socklen_t> vAddrLens;
+
+		for(size_t i = 0; i < vsBindHosts.size() || i == 0; i++)
+		{
+			sockaddr_storage ss;
+			socklen_t uLen;
+			if(!ResolveBindHost(i < vsBindHosts.size() ? vsBindHosts[i] : std::string(), uPort, ss, uLen, sError))
+				return false;
+			vAddrs.push_back(ss);
+			vAddrLens.push_back(uLen);
+		}
+
+		m_iWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(m_iWakeFd < 0)
+		{
+			sError = std::string("eventfd: ") + strerror(errno);
+			return false;
+		}
+
+		// all listeners first, so a port that is taken fails the whole start:
+		for(unsigned int i = 0; i < uWorkers; i++)
+		{
+			CWorker *pWorker = new CWorker;
+			m_vWorkers.push_back(pWorker);
+
+			pWorker->iEpollFd = epoll_create1(EPOLL_CLOEXEC);
+			if(pWorker->iEpollFd < 0)
+			{
+				sError = std::string("epoll: ") + strerror(errno);
+				CloseFds();
+				return false;
+			}
+
+			for(size_t uAddr = 0; uAddr < vAddrs.size(); uAddr++)
+			{
+				const int iFd = OpenListener(vAddrs[uAddr], vAddrLens[uAddr], uWorkers > 1, uBacklog, sError);
+				if(iFd < 0)
+				{
+					sError = (uAddr < vsBindHosts.size() && !vsBindHosts[uAddr].empty() ? vsBindHosts[uAddr] : std::string("*")) + ": " + sError;
+					CloseFds();
+					return false;
+				}
+				pWorker->vListenFds.push_back(iFd);
+			}
+
+			WatchListeners(*pWorker, true);
+
+			epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u64 = EVENT_WAKE;
+			epoll_ctl(pWorker->iEpollFd, EPOLL_CTL_ADD, m_iWakeFd, &ev);
+		}
+
+		m_bStop.store(false, std::memory_order_relaxed);
+
+		// signals are ZNC's business, keep them on the main thread:
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+
+		for(CWorker *pWorker : m_vWorkers)
+		{
+			try
+			{
+				pWorker->thread = std::thread(&CIdentThreadServer::Run, this, pWorker);
+			}
+			catch(const std::system_error& e)
+			{
+				sError = std::string("thread: ") + e.what();
+				break;
+			}
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		if(!m_vWorkers.back()->thread.joinable())
+		{
+			Stop();
+			return false;
+		}
+
+		return true;
+	}
+
+	void Stop()
+	{
+		if(m_vWorkers.empty())
+			return;
+
+		m_bStop.store(true, std::memory_order_release);
+
+		const uint64_t uOne = 1;
+		if(write(m_iWakeFd, &uOne, sizeof(uOne)) < 0) {}
+
+		for(CWorker *pWorker : m_vWorkers)
+		{
+			if(pWorker->thread.joinable())
+				pWorker->thread.join();
+		}
+
+		CloseFds();
+	}
+
+	bool IsRunning() const { return !m_vWorkers.empty(); }
+	size_t GetWorkerCount() const { return m_vWorkers.size(); }
+
+	/** whether connections get answered or closed right away **/
+	void SetAnswering(bool bAnswering) { m_bAnswering.store(bAnswering, std::memory_order_relaxed); }
+
+	void SetLimits(unsigned int uMaxClients, unsigned int uReadTimeout, unsigned int uMaxLineLength)
+	{
+		m_uMaxClients.store(uMaxClients, std::memory_order_relaxed);
+		m_uReadTimeout.store(uReadTimeout, std::memory_order_relaxed);
+		m_uMaxLineLength.store(uMaxLineLength, std::memory_order_relaxed);
+	}
+
+	void SetPipeline(bool bPipeline, unsigned int uMaxQueries, unsigned int uIdleTimeout)
+	{
+		m_bPipeline.store(bPipeline, std::memory_order_relaxed);
+		m_uMaxQueries.store(uMaxQueries, std::memory_order_relaxed);
+		m_uIdleTimeout.store(uIdleTimeout, std::memory_order_relaxed);
+	}
+
+	/** the rate and burst for all workers together **/
+	void SetRateLimit(unsigned int uRate, unsigned int uBurst, size_t uCapacity)
+	{
+		m_uRate.store(uRate, std::memory_order_relaxed);
+		m_uBurst.store(uBurst, std::memory_order_relaxed);
+		m_uRateCapacity.store(uCapacity, std::memory_order_relaxed);
+		m_uRateGeneration.fetch_add(1, std::memory_order_release);
+	}
+
+	size_t GetOpenConnections() const { return m_uOpen.load(std::memory_order_relaxed); }
+};
+
+#endif /* !IDENTSERV_CORE_H */